@@ -0,0 +1,126 @@
+/*
+ Modbus CRC16 (polynomial 0xA001, initial value 0xFFFF)
+
+ Three interchangeable back-ends are available, selected with SW_CRC_ENGINE
+ before SmartWire.h is included:
+
+  SW_CRC_BITWISE  - 8 shift/xor iterations per byte, no tables
+  SW_CRC_NIBBLE   - two lookups per byte in a 16 entry (32 byte) table
+  SW_CRC_TABLE256 - one lookup per byte in a 256 entry (512 byte) table
+
+ Tables are generated by the compiler and live in PROGMEM on AVR, so they
+ cost flash but no RAM.
+
+ The CRC can be built incrementally with update() while bytes arrive;
+ value() returns it with bytes swapped exactly like calculateCRC() always
+ did, i.e. frame[n] = value() >> 8 puts crcLo on the wire first.
+*/
+
+#ifndef SmartCRC_h
+#define SmartCRC_h
+
+#include <inttypes.h>
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#else
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#ifndef pgm_read_word
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#endif
+#endif
+
+#define SW_CRC_BITWISE 0
+#define SW_CRC_NIBBLE 1
+#define SW_CRC_TABLE256 2
+
+#ifndef SW_CRC_ENGINE
+#define SW_CRC_ENGINE SW_CRC_TABLE256
+#endif
+
+#define SW_CRC_INIT 0xFFFF
+#define SW_CRC_POLY 0xA001
+
+// one bit of the reflected CRC shift register
+constexpr uint16_t swCrcShift(uint16_t crc)
+{
+	return (crc & 0x0001) ? ((crc >> 1) ^ SW_CRC_POLY) : (crc >> 1);
+}
+
+// crc shifted by bits positions; table entries are swCrcShift(i, 8) and (i, 4)
+constexpr uint16_t swCrcShift(uint16_t crc, uint8_t bits)
+{
+	return bits ? swCrcShift(swCrcShift(crc), bits - 1) : crc;
+}
+
+#define SW_CRC_R4(bits, i) swCrcShift(i, bits), swCrcShift(i + 1, bits), \
+	swCrcShift(i + 2, bits), swCrcShift(i + 3, bits)
+#define SW_CRC_R16(bits, i) SW_CRC_R4(bits, i), SW_CRC_R4(bits, i + 4), \
+	SW_CRC_R4(bits, i + 8), SW_CRC_R4(bits, i + 12)
+#define SW_CRC_R64(bits, i) SW_CRC_R16(bits, i), SW_CRC_R16(bits, i + 16), \
+	SW_CRC_R16(bits, i + 32), SW_CRC_R16(bits, i + 48)
+#define SW_CRC_R256(bits) SW_CRC_R64(bits, 0), SW_CRC_R64(bits, 64), \
+	SW_CRC_R64(bits, 128), SW_CRC_R64(bits, 192)
+
+// Template only so the tables can be defined in this header and still end
+// up in flash once, whichever translation units include it.
+template <int unused>
+struct SmartCRCTables
+{
+	static const uint16_t byteTable[256];
+	static const uint16_t nibbleTable[16];
+};
+
+template <int unused>
+const uint16_t SmartCRCTables<unused>::byteTable[256] PROGMEM = { SW_CRC_R256(8) };
+
+template <int unused>
+const uint16_t SmartCRCTables<unused>::nibbleTable[16] PROGMEM = { SW_CRC_R16(4, 0) };
+
+template <int engine>
+class SmartCRC16
+{
+	private:
+		uint16_t crc;
+	public:
+		SmartCRC16() : crc(SW_CRC_INIT) {}
+
+		static inline uint16_t step(uint16_t crc, uint8_t b)
+		{
+			if (engine == SW_CRC_TABLE256)
+			{
+				return (crc >> 8) ^ pgm_read_word(&SmartCRCTables<0>::byteTable[(crc ^ b) & 0xFF]);
+			}
+			else if (engine == SW_CRC_NIBBLE)
+			{
+				crc ^= b;
+				crc = (crc >> 4) ^ pgm_read_word(&SmartCRCTables<0>::nibbleTable[crc & 0x0F]);
+				return (crc >> 4) ^ pgm_read_word(&SmartCRCTables<0>::nibbleTable[crc & 0x0F]);
+			}
+			else
+			{
+				crc ^= b;
+				for (uint8_t j = 0; j < 8; j++)
+					crc = swCrcShift(crc);
+				return crc;
+			}
+		}
+
+		void reset() { crc = SW_CRC_INIT; }
+		void update(uint8_t b) { crc = step(crc, b); }
+		void update(const uint8_t* buffer, uint8_t length)
+		{
+			uint16_t c = crc;
+			for (uint8_t i = 0; i < length; i++)
+				c = step(c, buffer[i]);
+			crc = c;
+		}
+		// bytes swapped, see calculateCRC()
+		uint16_t value() const { return (uint16_t)((crc << 8) | (crc >> 8)); }
+};
+
+typedef SmartCRC16<SW_CRC_ENGINE> SmartCRC;
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ Layouts of the event value types listed in SmartWire.h, for
+ SmartWire.writeValue()/enqueueValue()/batchValue() and smartRead().
+
+ Each struct is the payload that follows the value type byte, its size
+ is the payload size. smartEncode() writes a struct as it goes on the wire
+ and smartRead() takes it back: floats in memory order, which is how
+ writeToBuf() sends them, and integers big endian like writeToBuf(),
+ batchReading() and Modbus registers. Sizes are fixed here and checked
+ below; a layout that does not fit a frame fails to compile where it is
+ sent.
+
+ Types 6 and 7 carry temperature and electricity as scaled integers:
+ no soft-float on either end and 15 instead of 21 bytes for electricity.
+ Each field's scale is part of the layout. Receivers that do not know a
+ type skip it, so old nodes keep working next to new senders.
+*/
+
+#ifndef SmartValues_h
+#define SmartValues_h
+
+// no padding on hosts that align floats, AVR never does
+#define SW_PACKED __attribute__((packed))
+
+#include <stdint.h>
+
+struct SW_PACKED SmartRelay {
+	enum { type = 1 };
+	unsigned char position; // 0 - off, 255 - on
+};
+
+struct SW_PACKED SmartTemperature {
+	enum { type = 2 };
+	float celsius;
+};
+
+struct SW_PACKED SmartFloatValue {
+	enum { type = 3 };
+	unsigned char id;
+	float value;
+};
+
+struct SW_PACKED SmartElectricity {
+	enum { type = 4 };
+	unsigned char sensor;
+	float realPower;
+	float powerFactor;
+	float vrms;
+	float irms;
+	float kwh; // total consumed by this sensor
+};
+
+struct SW_PACKED SmartTemperatureFixed {
+	enum { type = 6 };
+	enum { celsiusScale = 100 };
+	int16_t centiCelsius;
+	float celsius() const { return (float)centiCelsius / celsiusScale; }
+};
+
+struct SW_PACKED SmartElectricityFixed {
+	enum { type = 7 };
+	enum { powerScale = 1000, powerFactorScale = 1000, vrmsScale = 100, irmsScale = 1000, kwhScale = 1000 };
+	unsigned char sensor;
+	int32_t milliwatts;    // real power
+	int16_t perMille;      // power factor, negative when leading
+	uint16_t centivolts;   // Vrms
+	uint16_t milliamps;    // Irms
+	uint32_t wattHours;    // total consumed by this sensor
+	float realPower() const { return (float)milliwatts / powerScale; }
+	float powerFactor() const { return (float)perMille / powerFactorScale; }
+	float vrms() const { return (float)centivolts / vrmsScale; }
+	float irms() const { return (float)milliamps / irmsScale; }
+	float kwh() const { return (float)wattHours / kwhScale; }
+};
+
+struct SW_PACKED SmartRegisterChange {
+	enum { type = 8 };
+	uint16_t address;
+	uint16_t value;
+};
+
+static_assert(sizeof(SmartRelay) == 1, "SmartRelay layout");
+static_assert(sizeof(SmartTemperature) == 4, "SmartTemperature layout");
+static_assert(sizeof(SmartFloatValue) == 5, "SmartFloatValue layout");
+static_assert(sizeof(SmartElectricity) == 21, "SmartElectricity layout");
+static_assert(sizeof(SmartTemperatureFixed) == 2, "SmartTemperatureFixed layout");
+static_assert(sizeof(SmartElectricityFixed) == 15, "SmartElectricityFixed layout");
+static_assert(sizeof(SmartRegisterChange) == 4, "SmartRegisterChange layout");
+
+// Types whose payload holds an ID telling values of one sender apart:
+// value ID, sensor no or the low byte of the register address, which
+// comes second in the big endian address.
+#define SW_HAS_VALUE_ID(type) ((type) == 3 || (type) == 4 || (type) == 7 || (type) == 8)
+#define SW_VALUE_ID_OFFSET(type) ((type) == 8 ? 1 : 0)
+
+// big endian integers on the wire
+inline void smartPut16(unsigned char* out, uint16_t value)
+{
+	out[0] = value >> 8;
+	out[1] = value & 0xFF;
+}
+
+inline void smartPut32(unsigned char* out, uint32_t value)
+{
+	smartPut16(out, value >> 16);
+	smartPut16(out + 2, value & 0xFFFF);
+}
+
+inline uint16_t smartGet16(const unsigned char* in)
+{
+	return ((uint16_t)in[0] << 8) | in[1];
+}
+
+inline uint32_t smartGet32(const unsigned char* in)
+{
+	return ((uint32_t)smartGet16(in) << 16) | smartGet16(in + 2);
+}
+
+// Writes value to out as the sizeof(T) bytes of its payload. Types of
+// bytes and floats go as they are in memory.
+template <class T>
+inline void smartEncode(const T& value, unsigned char* out)
+{
+	const unsigned char* in = (const unsigned char*)&value;
+	for (unsigned char i = 0; i < sizeof(T); i++)
+		out[i] = in[i];
+}
+
+template <class T>
+inline void smartDecode(const unsigned char* in, T* value)
+{
+	unsigned char* out = (unsigned char*)value;
+	for (unsigned char i = 0; i < sizeof(T); i++)
+		out[i] = in[i];
+}
+
+inline void smartEncode(const SmartTemperatureFixed& value, unsigned char* out)
+{
+	smartPut16(out, value.centiCelsius);
+}
+
+inline void smartDecode(const unsigned char* in, SmartTemperatureFixed* value)
+{
+	value->centiCelsius = smartGet16(in);
+}
+
+inline void smartEncode(const SmartElectricityFixed& value, unsigned char* out)
+{
+	out[0] = value.sensor;
+	smartPut32(out + 1, value.milliwatts);
+	smartPut16(out + 5, value.perMille);
+	smartPut16(out + 7, value.centivolts);
+	smartPut16(out + 9, value.milliamps);
+	smartPut32(out + 11, value.wattHours);
+}
+
+inline void smartEncode(const SmartRegisterChange& value, unsigned char* out)
+{
+	smartPut16(out, value.address);
+	smartPut16(out + 2, value.value);
+}
+
+inline void smartDecode(const unsigned char* in, SmartRegisterChange* value)
+{
+	value->address = smartGet16(in);
+	value->value = smartGet16(in + 2);
+}
+
+inline void smartDecode(const unsigned char* in, SmartElectricityFixed* value)
+{
+	value->sensor = in[0];
+	value->milliwatts = smartGet32(in + 1);
+	value->perMille = smartGet16(in + 5);
+	value->centivolts = smartGet16(in + 7);
+	value->milliamps = smartGet16(in + 9);
+	value->wattHours = smartGet32(in + 11);
+}
+
+// Decodes a reading's payload (see SmartReadings) into value, returns 0
+// when it holds another value type or has the wrong length.
+template <class T>
+inline unsigned char smartRead(unsigned char type, const unsigned char* payload, unsigned char length, T* value)
+{
+	if (!payload || type != T::type || length != sizeof(T))
+		return 0;
+	smartDecode(payload, value);
+	return 1;
+}
+
+#endif
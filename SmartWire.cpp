@@ -3,31 +3,185 @@
 
 // frame[] is used to recieve and transmit packages. 
 // The maximum wire buffer size is 32
-unsigned char SmartTwoWire::frame[BUFFER_LENGTH];
-unsigned char SmartTwoWire::frameLength;
-unsigned int SmartTwoWire::holdingRegsSize; // size of the register array
-unsigned int* SmartTwoWire::regs; // user array address
-unsigned char SmartTwoWire::broadcastFlag;
-unsigned char SmartTwoWire::slaveID;
-unsigned char SmartTwoWire::function;
-unsigned int SmartTwoWire::errorCount;
-unsigned char SmartTwoWire::framePos;
-
-SmartData SmartTwoWire::readingsBuffer[20];
-unsigned char SmartTwoWire::assignedBufferIndex = 0;
-unsigned char SmartTwoWire::currentBufferIndex = 0;
-unsigned char SmartTwoWire::isDataAvailable = 0;
-
-void (*SmartTwoWire::user_onEventReceive)(void);
+TWI_NODE_LOCAL unsigned char SmartTwoWire::frame[BUFFER_LENGTH];
+TWI_NODE_LOCAL unsigned char SmartTwoWire::frameLength;
+TWI_NODE_LOCAL const SmartBank* SmartTwoWire::banks;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::bankCount;
+TWI_NODE_LOCAL SmartBank SmartTwoWire::arrayBank; // the register array given to begin()
+TWI_NODE_LOCAL unsigned char SmartTwoWire::broadcastFlag;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::slaveID;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::function;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::errorCount;
+
+// events are built apart from frame[], which replies may overwrite from
+// the interrupt, and can be longer than one frame
+TWI_NODE_LOCAL unsigned char SmartTwoWire::eventBuffer[SW_EVENT_MAX_LENGTH];
+TWI_NODE_LOCAL unsigned char SmartTwoWire::eventPos;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::eventSeq;
+TWI_NODE_LOCAL void (*SmartTwoWire::fragmentCallback)(unsigned char);
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::fragmentsPending = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::fragmentStatus;
+#if SW_REASSEMBLY_SLOTS
+TWI_NODE_LOCAL SmartReassembly SmartTwoWire::reassembly[SW_REASSEMBLY_SLOTS];
+#endif
+
+// batches are kept to one frame, they exist to save frames
+TWI_NODE_LOCAL unsigned char SmartTwoWire::batchBuffer[BUFFER_LENGTH];
+TWI_NODE_LOCAL unsigned char SmartTwoWire::batchPos = 0;
+TWI_NODE_LOCAL unsigned long SmartTwoWire::batchStarted;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::batchLinger = SW_BATCH_LINGER_MS;
+
+TWI_NODE_LOCAL SmartCachedValue* SmartTwoWire::valueCache = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::valueCacheSize = 0;
+
+TWI_NODE_LOCAL SmartWatch* SmartTwoWire::watches;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::watchCount = 0;
+
+TWI_NODE_LOCAL SmartPoll* SmartTwoWire::pollTable;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::pollCount = 0;
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::pollPending = 0;
+TWI_NODE_LOCAL unsigned long SmartTwoWire::pollSentAt;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::pollsCompleted;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::pollsFailed;
+
+TWI_NODE_LOCAL SmartCachedRegister* SmartTwoWire::registerCache = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::registerCacheSize = 0;
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::cacheReadPending = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::cacheReadSlave;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::cacheReadStart;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::cacheReadCount;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::cacheHits;
+
+#if SW_ENABLE_RELIABLE
+// reliable events keep their frames until acked, they are resent as they are
+TWI_NODE_LOCAL SmartData SmartTwoWire::reliableFrames[SW_RELIABLE_WINDOW];
+TWI_NODE_LOCAL unsigned long SmartTwoWire::reliableSentAt[SW_RELIABLE_WINDOW];
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reliableRetransmitted = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reliableBase = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reliableNext = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reliableRetries = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reliableSynced = 0;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::reliableSrtt = 0;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::reliableRttvar = 0;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::reliableRto = SW_RELIABLE_INITIAL_RTO_MS;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reliablePeers[SW_RELIABLE_PEERS];
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reliableAcked[SW_RELIABLE_PEERS];
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reliablePeerCount = 0;
+TWI_NODE_LOCAL SmartReliableSender SmartTwoWire::reliableSenders[SW_RELIABLE_SENDERS];
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reliableSenderNext = 0;
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::ackInFlight = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::ackAttempts = 0;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::duplicateEvents;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::reliableRetransmits;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::reliableLost;
+#endif
+
+TWI_NODE_LOCAL unsigned char SmartTwoWire::addressedReplies = 0;
+#if SW_ENABLE_ADDRESSED_REPLIES
+TWI_NODE_LOCAL unsigned char SmartTwoWire::response[BUFFER_LENGTH];
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::responseLength = 0;
+#endif
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::replyAwaited = 0;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::cacheMisses;
+
+// readingsBuffer is a single producer (receive path), single consumer
+// (sketch) ring of [length][frame] records packed back to back. Records are
+// never split; a zero length byte tells the reader to continue at offset 0.
+TWI_NODE_LOCAL unsigned char SmartTwoWire::readingsBuffer[SW_READINGS_BUFFER_SIZE];
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::readingsHead = 0;
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::readingsTail = 0;
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::eventsStored = 0;
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::eventsReleased = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::reservedStart;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::droppedEvents;
+
+#if SW_RX_QUEUE_LENGTH
+TWI_NODE_LOCAL SmartFrame SmartTwoWire::rxQueue[SW_RX_QUEUE_LENGTH];
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::rxQueueHead = 0;
+TWI_NODE_LOCAL volatile unsigned char SmartTwoWire::rxQueueTail = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::deferred = 0;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::droppedFrames;
+#endif
+TWI_NODE_LOCAL unsigned long SmartTwoWire::receiveMaxMicros;
+
+#define SW_RX_OPEN 0     // receiving, nothing wrong so far
+#define SW_RX_VERIFIED 1 // complete with a correct CRC
+#define SW_RX_REJECTED 2 // refused, the rest of the frame is NACKed
+#define SW_RX_UNKNOWN 3  // addressed request of a function we lack, its length is unknown
+
+TWI_NODE_LOCAL SmartCRC SmartTwoWire::rxCrc;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::rxLength; // frame length from the header, 0 until known
+TWI_NODE_LOCAL unsigned char SmartTwoWire::rxFunction;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::rxCrcHigh;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::rxStatus = SW_RX_REJECTED;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::rxGeneralCall;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::rxSender;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::rxValueType;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::rxTypeIndex;
+
+TWI_NODE_LOCAL unsigned char SmartTwoWire::filterSenderMask = 0;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::filterSenderMatch = 0;
+TWI_NODE_LOCAL unsigned long SmartTwoWire::filterTypes = 0xFFFFFFFF;
+TWI_NODE_LOCAL unsigned char SmartTwoWire::filterIds[SW_FILTER_IDS];
+TWI_NODE_LOCAL unsigned char SmartTwoWire::filterIdCount = 0;
+TWI_NODE_LOCAL unsigned int SmartTwoWire::filteredEvents;
+
+TWI_NODE_LOCAL void (*SmartTwoWire::user_onEventReceive)(void);
 
 void SmartTwoWire::begin(unsigned char _slaveID, unsigned int _holdingRegsSize, unsigned int* _regs){
+	arrayBank.start = 0;
+	arrayBank.count = _holdingRegsSize;
+	arrayBank.kind = SW_BANK_RAM;
+	arrayBank.regs = _regs;
+	begin(_slaveID, &arrayBank, 1);
+}
+
+void SmartTwoWire::begin(unsigned char _slaveID, const SmartBank* _banks, unsigned char _bankCount){
 	TwoWire::begin(_slaveID);
-  	TWAR = (_slaveID << 1) | 1;  // enable broadcasts to be received
+  	twi_setGeneralCall(1);  // enable broadcasts to be received
 	slaveID = _slaveID;
-    onReceive(onDataReceived);
-  holdingRegsSize = _holdingRegsSize; 
-  regs = _regs;
+    twi_attachSlaveRxEvent(onDataReceived); // replaces TwoWire::onReceiveService
+    twi_attachSlaveRxByte(onDataByte);
+  banks = _banks;
+  bankCount = _bankCount;
   errorCount = 0; // initialize errorCount
+#if SW_RX_QUEUE_LENGTH
+  droppedFrames = 0;
+#endif
+  droppedEvents = 0;
+  filteredEvents = 0;
+#if SW_ENABLE_RELIABLE
+  duplicateEvents = 0;
+  reliableRetransmits = 0;
+  reliableLost = 0;
+#endif
+  pollsCompleted = 0;
+  pollsFailed = 0;
+  receiveMaxMicros = 0;
+}
+
+// the interrupt may update any of them between two byte reads
+void SmartTwoWire::getStats(SmartStats* stats)
+{
+	unsigned char sreg = SREG;
+	cli();
+	stats->errorCount = errorCount;
+#if SW_RX_QUEUE_LENGTH
+	stats->droppedFrames = droppedFrames;
+#endif
+	stats->receiveMaxMicros = receiveMaxMicros;
+	stats->droppedEvents = droppedEvents;
+	stats->filteredEvents = filteredEvents;
+#if SW_ENABLE_RELIABLE
+	stats->duplicateEvents = duplicateEvents;
+	stats->reliableRetransmits = reliableRetransmits;
+	stats->reliableLost = reliableLost;
+#endif
+	stats->pollsCompleted = pollsCompleted;
+	stats->pollsFailed = pollsFailed;
+	stats->cacheHits = cacheHits;
+	stats->cacheMisses = cacheMisses;
+	SREG = sreg;
 }
 
 // sets function called on slave write
@@ -36,168 +190,832 @@ void SmartTwoWire::onEventReceive( void (*function)(void) )
   user_onEventReceive = function;
 }
 
-void SmartTwoWire::onDataReceived(int howMany)
+// Called from the TWI interrupt for every received byte, before the next
+// one is acknowledged. The frame length comes from the header (byte count
+// of events, replies, function 16 and 23), the CRC is built as bytes arrive
+// and anything that cannot become a valid frame is refused on the spot:
+// the master sees a NACK instead of sending the rest.
+// Replies from other slaves arrive by general call and are accepted so
+// the slave sending them is not NACKed, but they are not requests.
+// Events the node did not subscribe to are NACKed the same way once the
+// header bytes the filter needs are in.
+unsigned char SmartTwoWire::onDataByte(unsigned char b, unsigned char index, unsigned char generalCall)
 {
-	SmartWire.readData(howMany);
+	if (index == 0) {
+		if (rxStatus == SW_RX_VERIFIED)
+			errorCount++; // the last one ran on after its CRC, was NACKed and never stopped
+		rxCrc.reset();
+		rxLength = 0;
+		rxStatus = SW_RX_OPEN;
+		rxGeneralCall = generalCall;
+		rxTypeIndex = 0;
+	}
+	else if (rxStatus == SW_RX_UNKNOWN)
+		return 1; // up to the STOP, onDataReceived() checks the CRC
+	else if (rxStatus != SW_RX_OPEN) {
+		// more bytes than the header announced
+		if (rxStatus == SW_RX_VERIFIED)
+			return rejectFrame();
+		return 0;
+	}
+
+	if (rxLength == 0 || index < rxLength - 2) {
+		unsigned int length = 0;
+		rxCrc.update(b);
+		
+		if (index == 0)
+			rxSender = b;
+		else if (index == 1) {
+			rxFunction = b;
+#if SW_ENABLE_ADDRESSED_REPLIES
+			if (!generalCall && b != SW_FUNCTION_ACK)
+				responseLength = 0; // a new request, the master gave up on the last one
+#endif
+#if !SW_REASSEMBLY_SLOTS
+			if (b == SW_FUNCTION_FRAGMENT)
+				return rejectFrame(); // nowhere to reassemble it
+#endif
+#if !SW_ENABLE_RELIABLE
+			if (b == SW_FUNCTION_RELIABLE || b == SW_FUNCTION_ACK)
+				return rejectFrame(); // ILLEGAL FUNCTION, reliable events are left out
+#endif
+			if ((b == 3 && !generalCall) || b == 6)
+				length = 8; // request, or the echo a function 6 reply is
+			else if ((b & 0x80) && generalCall)
+				length = 5; // exception reply
+			else if (b == 16 && generalCall && rxSender != 0)
+				length = 8; // reply, an echo; broadcast requests are from address 0
+			else if (b == SW_FUNCTION_ACK && !generalCall)
+				length = 5;
+			else if (b != 0 && b != 3 && b != 16 && b != 23 && b != SW_FUNCTION_FRAGMENT &&
+				b != SW_FUNCTION_RELIABLE) {
+				if (generalCall)
+					return rejectFrame(); // ILLEGAL FUNCTION, nobody answers a broadcast
+				rxStatus = SW_RX_UNKNOWN; // the master gets exception 1
+				return 1;
+			}
+			else if ((b == 0 || b == SW_FUNCTION_FRAGMENT || b == SW_FUNCTION_RELIABLE) &&
+				(rxSender & filterSenderMask) != filterSenderMatch)
+				return filterFrame();
+			if (b == 0)
+				rxTypeIndex = 3;
+			else if (b == SW_FUNCTION_RELIABLE)
+				rxTypeIndex = 5; // after the sequence numbers
+		}
+		else if (index == 2 && (rxFunction == 0 || rxFunction == SW_FUNCTION_FRAGMENT ||
+			rxFunction == SW_FUNCTION_RELIABLE)) {
+			length = b + 6; // id, function, count, data, crc
+			if (length < (rxFunction == SW_FUNCTION_RELIABLE ? 10 : 8)) // the minimum packet is 8 bytes
+				return rejectFrame();
+		}
+		else if (index == rxTypeIndex) {
+			rxValueType = b;
+			if (!(filterTypes & (1UL << (b < 31 ? b : 31))))
+				return filterFrame();
+		}
+		else if (rxTypeIndex && index == rxTypeIndex + 1 + SW_VALUE_ID_OFFSET(rxValueType) &&
+			filterIdCount && SW_HAS_VALUE_ID(rxValueType)) {
+			unsigned char i = 0;
+			while (i < filterIdCount && filterIds[i] != b)
+				i++;
+			if (i == filterIdCount)
+				return filterFrame();
+		}
+		else if (index == 2 && (rxFunction == 3 || rxFunction == 23) && generalCall)
+			length = b + 5; // reply: id, function, byte count, registers, crc
+		else if (index == 6 && rxFunction == 16)
+			length = b + 9; // id, function, address, registers, byte count, data, crc
+		else if (index == 10 && rxFunction == 23 && !generalCall)
+			length = b + 13; // id, function, read and write address and registers, byte count, data, crc
+		
+		if (length > BUFFER_LENGTH)
+			return rejectFrame(); // would not fit, don't wait for the rest
+		if (length)
+			rxLength = length;
+	}
+	else if (index == rxLength - 2)
+		rxCrcHigh = b;
+	else {
+		// last byte, anything after it gets a NACK
+		if (rxCrc.value() != (unsigned int)((rxCrcHigh << 8) | b))
+			return rejectFrame(); // checksum failed
+		rxStatus = SW_RX_VERIFIED;
+		return 0;
+	}
+	return 1;
+}
+
+unsigned char SmartTwoWire::rejectFrame()
+{
+	rxStatus = SW_RX_REJECTED;
+	errorCount++;
+	return 0;
+}
+
+// not an error, the node did not subscribe to it
+unsigned char SmartTwoWire::filterFrame()
+{
+	rxStatus = SW_RX_REJECTED;
+	filteredEvents++;
+	return 0;
+}
+
+// The filter is only read by onDataByte(), between frames nothing uses
+// it, but a frame arriving halfway through a change could see a mix.
+void SmartTwoWire::setEventFilter(unsigned char senderMask, unsigned char senderMatch, unsigned long types)
+{
+	unsigned char sreg = SREG;
+	cli();
+	filterSenderMask = senderMask;
+	filterSenderMatch = senderMatch & senderMask;
+	filterTypes = types;
+	SREG = sreg;
+}
+
+unsigned char SmartTwoWire::addEventFilterId(unsigned char id)
+{
+	if (filterIdCount == SW_FILTER_IDS)
+		return 0;
+	filterIds[filterIdCount] = id;
+	SW_BARRIER(); // the interrupt may look at the new entry once it is counted
+	filterIdCount++;
+	return 1;
+}
+
+void SmartTwoWire::clearEventFilter()
+{
+	setEventFilter(0, 0, 0xFFFFFFFF);
+	filterIdCount = 0;
+}
+
+// Called from the TWI interrupt with twi_rxBuffer itself, bypassing the
+// TwoWire rxBuffer copy, once the STOP arrives. Only frames onDataByte()
+// verified get through; nothing is checked twice.
+void SmartTwoWire::onDataReceived(unsigned char* inBytes, int numBytes)
+{
+	unsigned long start = micros();
+	
+	if (numBytes == 0)
+		return;
+	if (rxStatus == SW_RX_UNKNOWN) {
+		rxStatus = SW_RX_REJECTED;
+		if (numBytes < 4 || SmartWire.calculateCRC(inBytes, numBytes - 2) !=
+			(unsigned int)((inBytes[numBytes - 2] << 8) | inBytes[numBytes - 1])) {
+			errorCount++;
+			return;
+		}
+		rxStatus = SW_RX_VERIFIED;
+		rxLength = numBytes;
+	}
+	if (rxStatus != SW_RX_VERIFIED || numBytes != rxLength) {
+		if (rxStatus == SW_RX_OPEN)
+			errorCount++; // corrupted packet, cut short
+		rxStatus = SW_RX_REJECTED;
+		return;
+	}
+	rxStatus = SW_RX_REJECTED; // consumed
+	
+#if SW_RX_QUEUE_LENGTH
+	if (deferred)
+		SmartWire.queueData(inBytes, numBytes, rxGeneralCall);
+	else
+#endif
+		SmartWire.processFrame(inBytes, numBytes, rxGeneralCall);
+	
+	unsigned long elapsed = micros() - start;
+	if (elapsed > receiveMaxMicros)
+		receiveMaxMicros = elapsed;
 }
 
-void SmartTwoWire::readData(int howMany)
+#if SW_RX_QUEUE_LENGTH
+// interrupt context: copy the frame and leave processing to poll()
+void SmartTwoWire::queueData(unsigned char* inBytes, unsigned char numBytes, unsigned char generalCall)
 {
-	if (TwoWire::available() == 0) {
+	unsigned char head = rxQueueHead;
+	if ((unsigned char)(head - rxQueueTail) == SW_RX_QUEUE_LENGTH) {
+		droppedFrames++;
 		return;
 	}
+	
+	SmartFrame* slot = &rxQueue[head & (SW_RX_QUEUE_LENGTH - 1)];
+	for (unsigned char i = 0; i < numBytes; i++)
+		slot->data.buffer[i] = inBytes[i];
+	slot->data.length = numBytes;
+	slot->generalCall = generalCall;
+	
+	SW_BARRIER();
+	rxQueueHead = head + 1;
+}
+#endif
+
+// main loop: handle frames queued by the interrupt in deferred mode
+void SmartTwoWire::poll()
+{
+#if SW_RX_QUEUE_LENGTH
+	while (rxQueueTail != rxQueueHead) {
+		SmartFrame* slot = &rxQueue[rxQueueTail & (SW_RX_QUEUE_LENGTH - 1)];
+		processFrame(slot->data.buffer, slot->data.length, slot->generalCall);
+		rxQueueTail++;
+	}
+#endif
+	
+	if (watchCount)
+		publishChanges();
+	if (pollCount || registerCacheSize) {
+#if SW_ENABLE_ADDRESSED_REPLIES
+		if (replyAwaited)
+			fetchReply(); // blocking read, not from the interrupt
+#endif
+		unsigned char sreg = SREG;
+		cli(); // replies finish reads and start the next from the interrupt
+		if (!pollPending && !cacheReadPending)
+			startPoll();
+		else if (millis() - pollSentAt > SW_POLL_TIMEOUT_MS)
+			finishPoll(0);
+		SREG = sreg;
+	}
+#if SW_ENABLE_RELIABLE
+	if (reliableBase != reliableNext || !ackInFlight) {
+		unsigned char sreg = SREG;
+		cli(); // acks move the window from the interrupt
+		if (reliableBase != reliableNext)
+			retransmitReliable();
+		if (!ackInFlight)
+			sendAck(); // any that found the TX queue full
+		SREG = sreg;
+	}
+#endif
+	if (batchPos && millis() - batchStarted >= batchLinger)
+		sendBatch();
+	twi_poll(); // a queued frame held back by a backoff or the publish slot
+}
 
-	  unsigned char bufferLength = 0;
-	  unsigned char overflow = 0;
-	  unsigned char buffer[BUFFER_LENGTH];
-	  
-
-	  while (TwoWire::available() > 0){
-		  if (overflow) 
-			  read();
-		  else
-		  {
-			  if (bufferLength == BUFFER_LENGTH)
-				  overflow = 1;
-			  buffer[bufferLength] = read();
-			  bufferLength++;
-		  }
-	  }
-
-	  // If an overflow occurred increment the errorCount
-	  // variable and return to the main sketch without 
-	  // responding to the request i.e. force a timeout
-	  if (overflow)
-		  return;
-
-	  // The minimum request packet is 8 bytes for function 3 & 16
-    if (bufferLength > 7) 
+#if SW_RX_QUEUE_LENGTH
+void SmartTwoWire::setDeferred(unsigned char enabled)
+{
+	deferred = enabled;
+}
+#endif
+
+// buffer holds a complete frame verified by onDataByte(): its length
+// matches the header and the CRC is correct
+void SmartTwoWire::processFrame(unsigned char* buffer, unsigned char bufferLength, unsigned char generalCall)
+{
+	function = buffer[1];
+	broadcastFlag = generalCall;
+	unsigned int startingAddress = ((buffer[2] << 8) | buffer[3]); // combine the starting address bytes
+	unsigned int no_of_registers = ((buffer[4] << 8) | buffer[5]); // combine the number of register bytes
+	const SmartBank* bank;
+	const SmartBank* writeBank;
+	unsigned char exception = 0;
+	unsigned char index;
+	
+	// answers to pollSlaves() and readCached() come back by general call
+	// like any reply
+	if (generalCall && (function == 3 || function == (3 | 0x80))) {
+		if (pollCount || registerCacheSize)
+			pollReply(buffer, bufferLength);
+		return;
+	}
+	
+	// broadcasting is only supported for function 16 from address 0, a
+	// function 3, 6, 16, 23 or exception frame seen by general call is
+	// another slave's reply
+	if (generalCall && function != 0 && (function != 16 || buffer[0] != 0) &&
+		function != SW_FUNCTION_FRAGMENT && function != SW_FUNCTION_RELIABLE)
+		return;
+	
+	if (function == 3)
 	{
-		unsigned char id = buffer[0];
-		
-        unsigned int crc = ((buffer[bufferLength - 2] << 8) | buffer[bufferLength - 1]); // combine the crc Low & High bytes
-        if (calculateCRC(buffer, bufferLength - 2) == crc) // if the calculated crc matches the recieved crc continue
-        {
-				  function = buffer[1];
-				  unsigned int startingAddress = ((buffer[2] << 8) | buffer[3]); // combine the starting address bytes
-				  unsigned int no_of_registers = ((buffer[4] << 8) | buffer[5]); // combine the number of register bytes	
-				  unsigned int maxData = startingAddress + no_of_registers;
-				  unsigned char index;
-				  unsigned char address;
-				  unsigned int crc16;
-				
-				  // broadcasting is not supported for function 3 
-				  if (function == 3)
-				  {
-					  if (startingAddress < holdingRegsSize) // check exception 2 ILLEGAL DATA ADDRESS
-					  {
-						  if (maxData <= holdingRegsSize) // check exception 3 ILLEGAL DATA VALUE
-						  {
-							  unsigned char noOfBytes = no_of_registers * 2; 
-                // ID, function, noOfBytes, (dataLo + dataHi)*number of registers,
-                //  crcLo, crcHi
-							  unsigned char responseFrameSize = 5 + noOfBytes; 
-							  frame[0] = slaveID;
-							  frame[1] = function;
-							  frame[2] = noOfBytes;
-							  address = 3; // PDU starts at the 4th byte
-							  unsigned int temp;
-							
-							  for (index = startingAddress; index < maxData; index++)
-						  	{
-								  temp = regs[index];
-								  frame[address] = temp >> 8; // split the register into 2 bytes
-								  address++;
-								  frame[address] = temp & 0xFF;
-								  address++;
-							  }	
-							
-							  crc16 = calculateCRC(frame, responseFrameSize - 2);
-							  frame[responseFrameSize - 2] = crc16 >> 8; // split crc into 2 bytes
-							  frame[responseFrameSize - 1] = crc16 & 0xFF;
-							  sendPacket(responseFrameSize);
-						  }
-						  else	
-							  exceptionResponse(3); // exception 3 ILLEGAL DATA VALUE
-					  }
-					  else
-						  exceptionResponse(2); // exception 2 ILLEGAL DATA ADDRESS
-				  }
-				  else if (function == 16)
-				  {
-					  // Check if the recieved number of bytes matches the calculated bytes 
-            // minus the request bytes.
-					  // id + function + (2 * address bytes) + (2 * no of register bytes) + 
-            // byte count + (2 * CRC bytes) = 9 bytes
-					  if (frame[6] == (bufferLength - 9)) 
-					  {
-						  if (startingAddress < holdingRegsSize) // check exception 2 ILLEGAL DATA ADDRESS
-						  {
-							  if (maxData <= holdingRegsSize) // check exception 3 ILLEGAL DATA VALUE
-							  {
-								  address = 7; // start at the 8th byte in the frame
-								
-								  for (index = startingAddress; index < maxData; index++)
-							  	{
-									  regs[index] = ((frame[address] << 8) | frame[address + 1]);
-									  address += 2;
-								  }	
-								
-								  // only the first 6 bytes are used for CRC calculation
-								  crc16 = calculateCRC(frame, 6); 
-								  frame[6] = crc16 >> 8; // split crc into 2 bytes
-								  frame[7] = crc16 & 0xFF;
-								
-								  // a function 16 response is an echo of the first 6 bytes from 
-                  // the request + 2 crc bytes
-								  if (!broadcastFlag) // don't respond if it's a broadcast message
-									  sendPacket(8); 
-							  }
-							  else	
-								  exceptionResponse(3); // exception 3 ILLEGAL DATA VALUE
-						  }
-						  else
-							  exceptionResponse(2); // exception 2 ILLEGAL DATA ADDRESS
-					  }
-					  else 
-						  errorCount++; // corrupted packet
-				  }
-				  else if (function == 0) { // this packet is event
-				  // Check if the recieved number of bytes matches the calculated bytes 
-            // minus the request bytes.
-					  // id + function + (2 * address bytes) + (2 * no of register bytes) + 
-            // byte count + (2 * CRC bytes) = 9 bytes
-					  if (buffer[2] == (bufferLength - 6)) 
-					  {
-						  assignedBufferIndex++;
-						  isDataAvailable = 1;
-						  if (assignedBufferIndex==20)
-							assignedBufferIndex = 0;
-							
-							for (int i=0; i<BUFFER_LENGTH; i++)
-							  readingsBuffer[assignedBufferIndex].buffer[i] = buffer[i];
-							
-						  readingsBuffer[assignedBufferIndex].length = bufferLength;
-
-						  if (user_onEventReceive) {
-							  user_onEventReceive();
-						  }
-					  }
-					  else 
-						  errorCount++; // corrupted packet
-				  }
-				  else
-					  exceptionResponse(1); // exception 1 ILLEGAL FUNCTION
-        }
-			  else { // checksum failed
-				errorCount++;
+		exception = checkRange(startingAddress, no_of_registers, SW_MAX_READ_REGISTERS, 0, &bank);
+		if (!exception)
+			exception = replyRegisters(bank, startingAddress, no_of_registers);
+	}
+	else if (function == 6)
+	{
+		// bytes 4 and 5 are the value, the response is an echo of the request
+		exception = checkRange(startingAddress, 1, 1, 1, &bank);
+		if (!exception)
+			exception = writeRegisters(bank, startingAddress, 1, buffer + 4);
+		if (!exception) {
+			for (index = 0; index < 8; index++)
+				frame[index] = buffer[index];
+			sendReply(8);
+		}
+	}
+	else if (function == 16)
+	{
+		// id + function + (2 * address bytes) + (2 * no of register bytes) +
+		// byte count + data + (2 * CRC bytes), onDataByte() took the length
+		// from the byte count
+		exception = buffer[6] == no_of_registers * 2 ?
+			checkRange(startingAddress, no_of_registers, no_of_registers, 1, &bank) : 3;
+		if (!exception)
+			exception = writeRegisters(bank, startingAddress, no_of_registers, buffer + 7);
+		if (!exception) {
+			// a function 16 response is an echo of the first 6 bytes from
+			// the request + 2 crc bytes
+			for (index = 0; index < 6; index++)
+				frame[index] = buffer[index];
+			unsigned int crc16 = calculateCRC(frame, 6);
+			frame[6] = crc16 >> 8; // split crc into 2 bytes
+			frame[7] = crc16 & 0xFF;
+			if (!broadcastFlag) // don't respond if it's a broadcast message
+				sendReply(8);
+		}
+	}
+	else if (function == 23)
+	{
+		// read address, read count, write address, write count, byte count,
+		// data; the write is done first and the response is as for function 3
+		unsigned int writeAddress = ((buffer[6] << 8) | buffer[7]);
+		unsigned int writeRegisterCount = ((buffer[8] << 8) | buffer[9]);
+		exception = checkRange(startingAddress, no_of_registers, SW_MAX_READ_REGISTERS, 0, &bank);
+		if (!exception)
+			exception = buffer[10] == writeRegisterCount * 2 ?
+				checkRange(writeAddress, writeRegisterCount, writeRegisterCount, 1, &writeBank) : 3;
+		if (!exception)
+			exception = writeRegisters(writeBank, writeAddress, writeRegisterCount, buffer + 11);
+		if (!exception)
+			exception = replyRegisters(bank, startingAddress, no_of_registers);
+	}
+	else if (function == 0) { // this packet is event
+		// id + function + byte count + data + (2 * CRC bytes) = 5 bytes
+		if (buffer[2] == (bufferLength - 6))
+		{
+			if (storeEvent(buffer, bufferLength) && user_onEventReceive) {
+				user_onEventReceive();
 			}
-    }
-	else if (bufferLength > 0 && bufferLength < 8) {
-		  errorCount++; // corrupted packet
+		}
+		else
+			errorCount++; // corrupted packet
+	}
+#if SW_REASSEMBLY_SLOTS
+	else if (function == SW_FUNCTION_FRAGMENT)
+		reassemble(buffer, bufferLength);
+#endif
+#if SW_ENABLE_RELIABLE
+	else if (function == SW_FUNCTION_RELIABLE) {
+		if (buffer[2] == bufferLength - 6)
+			receiveReliable(buffer, bufferLength);
+		else
+			errorCount++;
+	}
+	else if (function == SW_FUNCTION_ACK)
+		reliableAck(buffer[0], buffer[2] & 0x7F);
+#endif
+	else if (!generalCall)
+		exception = 1; // ILLEGAL FUNCTION
+	
+	if (exception)
+		exceptionResponse(exception);
+}
+
+// Banks are sorted by start and do not overlap.
+const SmartBank* SmartTwoWire::findBank(unsigned int address)
+{
+	unsigned char low = 0;
+	unsigned char high = bankCount;
+	
+	while (low < high) {
+		unsigned char middle = (low + high) / 2;
+		const SmartBank* bank = &banks[middle];
+		if (address < bank->start)
+			high = middle;
+		else if (address - bank->start >= bank->count)
+			low = middle + 1;
+		else
+			return bank;
 	}
+	return 0;
+}
+
+// Range check shared by all register functions: the exception code, or 0
+// when count is 1 to maxCount and all the registers are in one bank that
+// can be written if write is set.
+unsigned char SmartTwoWire::checkRange(unsigned int start, unsigned int count, unsigned int maxCount,
+	unsigned char write, const SmartBank** bank)
+{
+	const SmartBank* found = findBank(start);
+	
+	if (!found || (write && found->kind == SW_BANK_PROGMEM))
+		return 2; // exception 2 ILLEGAL DATA ADDRESS
+	if (count == 0 || count > maxCount || count > found->count - (start - found->start))
+		return 3; // exception 3 ILLEGAL DATA VALUE
+	*bank = found;
+	return 0;
+}
+
+unsigned char SmartTwoWire::readRegister(const SmartBank* bank, unsigned int address, unsigned int* value)
+{
+	unsigned int offset = address - bank->start;
+	
+	if (bank->kind == SW_BANK_RAM)
+		*value = bank->regs[offset];
+	else if (bank->kind == SW_BANK_PROGMEM)
+		*value = pgm_read_word(&bank->progmem[offset]);
+	else
+		return bank->access(address, value, 0);
+	return 0;
 }
 
+// ID, function, noOfBytes, (dataLo + dataHi)*number of registers, crcLo, crcHi
+unsigned char SmartTwoWire::replyRegisters(const SmartBank* bank, unsigned int start, unsigned int count)
+{
+	unsigned char noOfBytes = count * 2;
+	unsigned char responseFrameSize = 5 + noOfBytes;
+	unsigned char address = 3; // PDU starts at the 4th byte
+	unsigned char exception;
+	unsigned int temp;
+	
+	frame[0] = slaveID;
+	frame[1] = function;
+	frame[2] = noOfBytes;
+	for (unsigned int index = start; index < start + count; index++)
+	{
+		exception = readRegister(bank, index, &temp);
+		if (exception)
+			return exception;
+		frame[address] = temp >> 8; // split the register into 2 bytes
+		frame[address + 1] = temp & 0xFF;
+		address += 2;
+	}
+	
+	unsigned int crc16 = calculateCRC(frame, responseFrameSize - 2);
+	frame[responseFrameSize - 2] = crc16 >> 8; // split crc into 2 bytes
+	frame[responseFrameSize - 1] = crc16 & 0xFF;
+	sendReply(responseFrameSize);
+	return 0;
+}
+
+// a callback refusing a register stops the write there
+unsigned char SmartTwoWire::writeRegisters(const SmartBank* bank, unsigned int start, unsigned int count, const unsigned char* data)
+{
+	for (unsigned int index = start; index < start + count; index++)
+	{
+		unsigned int value = ((data[0] << 8) | data[1]);
+		if (bank->kind == SW_BANK_RAM)
+			bank->regs[index - bank->start] = value;
+		else {
+			unsigned char exception = bank->access(index, &value, 1);
+			if (exception)
+				return exception;
+		}
+		data += 2;
+	}
+	return 0;
+}
+
+#if SW_REASSEMBLY_SLOTS
+// Fragments of one event must arrive in order. A missing fragment, a new
+// event from the same sender or SW_REASSEMBLY_TIMEOUT_MS without the next
+// fragment drops what was collected so far.
+void SmartTwoWire::reassemble(unsigned char* buffer, unsigned char bufferLength)
+{
+	unsigned char sender = buffer[0];
+	unsigned char seq = buffer[3];
+	unsigned char number = buffer[4] & 0x7F;
+	unsigned char sliceLength = bufferLength - 7;
+	unsigned long now = millis();
+	SmartReassembly* slot = 0;
+	SmartReassembly* unused = 0;
+	unsigned char i;
+	
+	for (i = 0; i < SW_REASSEMBLY_SLOTS; i++) {
+		SmartReassembly* r = &reassembly[i];
+		if (r->next && r->sender != sender && now - r->updated > SW_REASSEMBLY_TIMEOUT_MS) {
+			r->next = 0; // stale, the rest is not coming
+			errorCount++;
+		}
+		if (r->next == 0) {
+			if (!unused)
+				unused = r;
+		}
+		else if (r->sender == sender)
+			slot = r;
+	}
+	
+	if (slot && (slot->seq != seq || slot->next != number ||
+		now - slot->updated > SW_REASSEMBLY_TIMEOUT_MS)) {
+		slot->next = 0; // a fragment went missing or came too late
+		errorCount++;
+		unused = slot;
+		slot = 0;
+	}
+	if (!slot) {
+		// the rest of an event whose start was lost, counted where it was lost
+		if (number != 0)
+			return;
+		if (!unused) {
+			droppedEvents++; // every slot busy with other senders
+			return;
+		}
+		slot = unused;
+		slot->sender = sender;
+		slot->seq = seq;
+		slot->length = 0;
+	}
+	
+	if (slot->length + sliceLength > SW_EVENT_MAX_LENGTH) {
+		slot->next = 0;
+		errorCount++;
+		return;
+	}
+	for (i = 0; i < sliceLength; i++)
+		slot->buffer[slot->length + i] = buffer[5 + i];
+	slot->length += sliceLength;
+	slot->next = number + 1;
+	slot->updated = now;
+	
+	if (buffer[4] & 0x80) { // last fragment
+		slot->next = 0;
+		if (slot->buffer[1] != 0 || slot->buffer[2] != slot->length - 6 ||
+			calculateCRC(slot->buffer, slot->length - 2) !=
+			(unsigned int)((slot->buffer[slot->length - 2] << 8) | slot->buffer[slot->length - 1]))
+			errorCount++;
+		else if (storeEvent(slot->buffer, slot->length) && user_onEventReceive)
+			user_onEventReceive();
+	}
+}
+#endif
+
+#if SW_ENABLE_RELIABLE
+unsigned char SmartTwoWire::enqueueReliable() {
+	finishEvent();
+	// id, function, count, sequence numbers, data, crc
+	unsigned char dataLength = eventPos - 5;
+	if (dataLength + 7 > BUFFER_LENGTH)
+		return 1;
+	
+	unsigned char sreg = SREG;
+	cli(); // acks move the window from the interrupt
+	if (SW_SEQ_DISTANCE(reliableNext, reliableBase) == SW_RELIABLE_WINDOW) {
+		SREG = sreg;
+		return 7;
+	}
+	unsigned char seq = reliableNext;
+	SmartData* slot = &reliableFrames[seq & (SW_RELIABLE_WINDOW - 1)];
+	slot->buffer[0] = slaveID;
+	slot->buffer[1] = SW_FUNCTION_RELIABLE;
+	slot->buffer[2] = dataLength + 1; // length - 6, as for events
+	for (unsigned char i = 0; i < dataLength; i++)
+		slot->buffer[5 + i] = eventBuffer[3 + i];
+	slot->length = dataLength + 7;
+	
+	unsigned char status = sendReliable(seq);
+	if (!status) {
+		reliableRetransmitted &= ~(1 << (seq & (SW_RELIABLE_WINDOW - 1)));
+		reliableNext = (seq + 1) & 0x7F;
+	}
+	SREG = sreg;
+	return status;
+}
+
+// interrupts off: queues the frame of seq with the current window start
+unsigned char SmartTwoWire::sendReliable(unsigned char seq) {
+	unsigned char index = seq & (SW_RELIABLE_WINDOW - 1);
+	SmartData* slot = &reliableFrames[index];
+	slot->buffer[3] = reliableSynced ? seq : seq | 0x80;
+	slot->buffer[4] = reliableBase;
+	unsigned int crc16 = calculateCRC(slot->buffer, slot->length - 2);
+	slot->buffer[slot->length - 2] = crc16 >> 8;
+	slot->buffer[slot->length - 1] = crc16 & 0xFF;
+	unsigned char status = twi_enqueue(0, slot->buffer, slot->length, 0);
+	if (!status)
+		reliableSentAt[index] = millis();
+	return status;
+}
+
+// Interrupts off, from poll(). Go-back-N: when the oldest event has not
+// been acked in time, it and every later one are sent again, receivers
+// drop what they already have.
+void SmartTwoWire::retransmitReliable() {
+	unsigned char base = reliableBase;
+	unsigned char index = base & (SW_RELIABLE_WINDOW - 1);
+	if (millis() - reliableSentAt[index] < reliableRto)
+		return;
+	
+	if (reliableRetries == SW_RELIABLE_RETRIES) {
+		// receivers still waiting for it catch up with the new base
+		reliableBase = (base + 1) & 0x7F;
+		for (unsigned char i = 0; i < (reliablePeerCount ? reliablePeerCount : 1); i++) {
+			if (reliableAcked[i] == base)
+				reliableAcked[i] = reliableBase;
+		}
+		reliableRetries = 0;
+		reliableRto = estimatedRto(); // the backoff was for this event
+		reliableLost++;
+		return;
+	}
+	
+	if (sendReliable(base))
+		return; // TX queue full, the next poll() tries again
+	reliableRetransmitted |= 1 << index;
+	reliableRetransmits++;
+	reliableRetries++;
+	reliableRto = reliableRto < SW_RELIABLE_MAX_RTO_MS / 2 ? reliableRto * 2 : SW_RELIABLE_MAX_RTO_MS;
+	for (unsigned char seq = (base + 1) & 0x7F; seq != reliableNext; seq = (seq + 1) & 0x7F) {
+		if (sendReliable(seq))
+			break; // left for the next timeout
+		reliableRetransmitted |= 1 << (seq & (SW_RELIABLE_WINDOW - 1));
+		reliableRetransmits++;
+	}
+}
+
+// An ack from a receiver, next is the event it expects next. The window
+// moves on once every peer has acked an event.
+void SmartTwoWire::reliableAck(unsigned char from, unsigned char next) {
+	unsigned char peers = reliablePeerCount ? reliablePeerCount : 1;
+	unsigned char peer = 0;
+	unsigned char sreg = SREG;
+	cli(); // poll() in deferred mode, retransmitReliable() runs with interrupts off
+	
+	if (reliablePeerCount) {
+		while (peer < reliablePeerCount && reliablePeers[peer] != from)
+			peer++;
+	}
+	unsigned char base = reliableBase;
+	unsigned char acked = SW_SEQ_DISTANCE(next, base);
+	if (peer == peers || acked > SW_SEQ_DISTANCE(reliableNext, base) ||
+		acked <= SW_SEQ_DISTANCE(reliableAcked[peer], base)) {
+		SREG = sreg; // not a peer, old or not ours
+		return;
+	}
+	reliableAcked[peer] = next;
+	
+	// Karn: the round trip of a retransmitted event is ambiguous. Every
+	// peer's progress counts, a dead one must not leave the timeout at
+	// its backoff.
+	unsigned char newest = (next - 1) & (SW_RELIABLE_WINDOW - 1);
+	if (!(reliableRetransmitted & (1 << newest)))
+		sampleRoundTrip(millis() - reliableSentAt[newest]);
+	
+	for (unsigned char i = 0; i < peers; i++) {
+		if (SW_SEQ_DISTANCE(reliableAcked[i], base) < acked)
+			acked = SW_SEQ_DISTANCE(reliableAcked[i], base);
+	}
+	if (acked) {
+		reliableBase = (base + acked) & 0x7F;
+		reliableRetries = 0;
+		reliableSynced = 1;
+	}
+	SREG = sreg;
+}
+
+// Jacobson/Karels: timeout = smoothed round trip + 4 * mean deviation
+void SmartTwoWire::sampleRoundTrip(unsigned long ms) {
+	int sample = ms < SW_RELIABLE_MAX_RTO_MS ? ms : SW_RELIABLE_MAX_RTO_MS;
+	
+	if (reliableSrtt == 0) {
+		reliableSrtt = sample << 3;
+		reliableRttvar = sample << 1;
+	}
+	else {
+		int delta = sample - (reliableSrtt >> 3);
+		reliableSrtt += delta;
+		if (delta < 0)
+			delta = -delta;
+		reliableRttvar += delta - (reliableRttvar >> 2);
+	}
+	reliableRto = estimatedRto();
+}
+
+unsigned int SmartTwoWire::estimatedRto() {
+	if (reliableSrtt == 0)
+		return SW_RELIABLE_INITIAL_RTO_MS;
+	unsigned int rto = (reliableSrtt >> 3) + reliableRttvar;
+	return rto < SW_RELIABLE_MIN_RTO_MS ? SW_RELIABLE_MIN_RTO_MS :
+		rto > SW_RELIABLE_MAX_RTO_MS ? SW_RELIABLE_MAX_RTO_MS : rto;
+}
+
+void SmartTwoWire::setReliablePeers(const unsigned char* ids, unsigned char count) {
+	if (count > SW_RELIABLE_PEERS)
+		count = SW_RELIABLE_PEERS;
+	unsigned char sreg = SREG;
+	cli();
+	for (unsigned char i = 0; i < count; i++)
+		reliablePeers[i] = ids[i];
+	for (unsigned char i = 0; i < SW_RELIABLE_PEERS; i++)
+		reliableAcked[i] = reliableNext;
+	reliablePeerCount = count;
+	reliableBase = reliableNext; // events in flight are not waited for any more
+	SREG = sreg;
+}
+
+unsigned char SmartTwoWire::reliablePending() {
+	return SW_SEQ_DISTANCE(reliableNext, reliableBase);
+}
+
+// Stores the event if it is the next one from its sender, and acks. A
+// frame past the expected one means an earlier one was lost, it is dropped
+// and comes again with it. Nothing is acked when the event storage is
+// full, so the sender retransmits.
+void SmartTwoWire::receiveReliable(unsigned char* buffer, unsigned char bufferLength)
+{
+	unsigned char seq = buffer[3] & 0x7F;
+	unsigned char syncing = buffer[3] >> 7;
+	unsigned char base = buffer[4] & 0x7F;
+	SmartReliableSender* sender = 0;
+	unsigned char i;
+	
+	for (i = 0; i < SW_RELIABLE_SENDERS; i++) {
+		if (reliableSenders[i].sender == buffer[0]) {
+			sender = &reliableSenders[i];
+			break;
+		}
+	}
+	if (!sender) {
+		sender = &reliableSenders[reliableSenderNext];
+		if (++reliableSenderNext == SW_RELIABLE_SENDERS)
+			reliableSenderNext = 0;
+		sender->sender = buffer[0];
+		sender->expected = base;
+		if (ackInFlight == sender - reliableSenders + 1)
+			ackInFlight = 0; // its ack is for the sender that had the entry
+	}
+	else if (syncing && !sender->syncing)
+		sender->expected = base; // the sender started over
+	sender->ackOwed = 1;
+	sender->syncing = syncing;
+	
+	unsigned char waiting = SW_SEQ_DISTANCE(sender->expected, base);
+	unsigned char offset = SW_SEQ_DISTANCE(seq, base);
+	if (waiting > SW_RELIABLE_WINDOW) {
+		sender->expected = base; // the sender gave up on what we wait for
+		waiting = 0;
+	}
+	
+	if (offset == waiting) {
+		// stored as the command 0 event it carries
+		unsigned char event[BUFFER_LENGTH];
+		unsigned char length = bufferLength - 2;
+		event[0] = buffer[0];
+		event[1] = 0;
+		event[2] = buffer[2] - 2;
+		for (i = 3; i < length - 2; i++)
+			event[i] = buffer[i + 2];
+		unsigned int crc16 = calculateCRC(event, length - 2);
+		event[length - 2] = crc16 >> 8;
+		event[length - 1] = crc16 & 0xFF;
+		if (!storeEvent(event, length))
+			return;
+		sender->expected = (sender->expected + 1) & 0x7F;
+		if (user_onEventReceive)
+			user_onEventReceive();
+	}
+	else if (offset < waiting)
+		duplicateEvents++;
+	
+	unsigned char sreg = SREG;
+	cli(); // poll() in deferred mode
+	sendAck();
+	SREG = sreg;
+}
+
+// Interrupts off. One ack in the TX queue at a time, it says what is
+// expected next when it is built. Acks owed meanwhile follow it.
+void SmartTwoWire::sendAck()
+{
+	if (ackInFlight)
+		return;
+	for (unsigned char i = 0; i < SW_RELIABLE_SENDERS; i++) {
+		SmartReliableSender* sender = &reliableSenders[i];
+		if (!sender->ackOwed)
+			continue;
+		
+		unsigned char ack[5];
+		ack[0] = slaveID;
+		ack[1] = SW_FUNCTION_ACK;
+		ack[2] = sender->expected;
+		unsigned int crc16 = calculateCRC(ack, 3);
+		ack[3] = crc16 >> 8;
+		ack[4] = crc16 & 0xFF;
+		if (twi_enqueue(sender->sender, ack, 5, onAckSent) == 0) { // else the next poll() tries again
+			sender->ackOwed = 0;
+			ackInFlight = i + 1;
+		}
+		return;
+	}
+}
+
+// Interrupt context. Every receiver acks the same broadcast at the same
+// moment and all but one lose arbitration, an ack that lost is sent again
+// right away. Losing means another frame got through, the limit is only
+// for status 4 from a bus error.
+void SmartTwoWire::onAckSent(unsigned char status)
+{
+	if (!ackInFlight)
+		return;
+	SmartReliableSender* sender = &reliableSenders[ackInFlight - 1];
+	ackInFlight = 0;
+	if (status == 4 && ++ackAttempts < 16)
+		sender->ackOwed = 1;
+	else
+		ackAttempts = 0;
+	SmartWire.sendAck();
+}
+#endif
+
 void SmartTwoWire::exceptionResponse(unsigned char exception)
 {
   // each call to exceptionResponse() will increment the errorCount
@@ -212,99 +1030,898 @@ void SmartTwoWire::exceptionResponse(unsigned char exception)
 		frame[4] = crc16 & 0xFF;
     // exception response is always 5 bytes 
     // ID, function + 0x80, exception code, 2 bytes crc
-		sendPacket(5); 
+		sendReply(5);
 	}
 }
 
 unsigned int SmartTwoWire::calculateCRC(unsigned char* buffer, unsigned char bufferSize) 
 {
-  unsigned int temp, temp2, flag;
-  temp = 0xFFFF;
-  for (unsigned char i = 0; i < bufferSize; i++)
-  {
-    temp = temp ^ buffer[i];
-    for (unsigned char j = 1; j <= 8; j++)
-    {
-      flag = temp & 0x0001;
-      temp >>= 1;
-      if (flag)
-        temp ^= 0xA001;
-    }
-  }
-  // Reverse byte order. 
-  temp2 = temp >> 8;
-  temp = (temp << 8) | temp2;
-  temp &= 0xFFFF; 
+  SmartCRC crc;
+  crc.update(buffer, bufferSize);
   // the returned value is already swapped
   // crcLo byte is first & crcHi byte is last
-  return temp; 
+  return crc.value(); 
 }
 
 void SmartTwoWire::sendPacket(unsigned char bufferSize)
 {
-  beginTransmission(0);
-		
-  for (unsigned char i = 0; i < bufferSize; i++)
-    write(frame[i]);
+  sendPacket(frame, bufferSize);
+  frameLength = bufferSize;
+}
 
+// Events are sent from the caller's buffer, never from frame[]: a reply
+// built by the interrupt while the bus is busy would overwrite it.
+void SmartTwoWire::sendPacket(const unsigned char* data, unsigned char bufferSize)
+{
+  beginTransmission(0);
+  write(data, bufferSize);
   endTransmission();
-  
+}
+
+// Replies to Modbus requests go through here: they may be produced in
+// interrupt context, where a blocking bus transaction can never finish.
+unsigned char SmartTwoWire::enqueuePacket(unsigned char bufferSize, void (*callback)(unsigned char))
+{
   frameLength = bufferSize;
+  return twi_enqueue(0, frame, bufferSize, callback);
+}
+
+// Replies to Modbus requests, from frame[]: queued by general call, or
+// held for the master to read in addressed mode
+void SmartTwoWire::sendReply(unsigned char bufferSize)
+{
+	if (!addressedReplies) {
+		enqueuePacket(bufferSize, 0);
+		return;
+	}
+#if SW_ENABLE_ADDRESSED_REPLIES
+	frameLength = bufferSize;
+	responseLength = 0;
+	SW_BARRIER();
+	for (unsigned char i = 0; i < bufferSize; i++)
+		response[i] = frame[i];
+	SW_BARRIER();
+	responseLength = bufferSize;
+#endif
+}
+
+#if SW_ENABLE_ADDRESSED_REPLIES
+// interrupt context: the master reads the response, once
+void SmartTwoWire::onResponseRequested()
+{
+	if (!responseLength)
+		return; // the TWI sends a single 0, not ready
+	twi_transmit(response, responseLength);
+	responseLength = 0;
+}
+
+void SmartTwoWire::setAddressedReplies(unsigned char enabled)
+{
+	addressedReplies = enabled;
+	responseLength = 0;
+	onRequest(enabled ? onResponseRequested : 0);
+}
+#endif
+
+void SmartTwoWire::beginEvent() {
+	eventBuffer[0] = slaveID;
+	eventBuffer[1] = 0x00;
+	eventBuffer[2] = 0x00;	// no of bytes
+	eventPos = 3;
 }
 
 void SmartTwoWire::initEvent() {
-	frame[0] = slaveID;
-	frame[1] = 0x00;
-	frame[2] = 0x00;	// no of bytes
-	framePos = 3;
+	beginEvent();
 }
 
-void SmartTwoWire::writeToBuf(unsigned char b) {
-	frame[framePos] = b;
-	framePos++;
+// the last 2 bytes of eventBuffer are kept for the CRC
+unsigned char SmartTwoWire::writeToBuf(unsigned char b) {
+	if (eventPos + 1 > SW_EVENT_MAX_LENGTH - 2)
+		return 0;
+	eventBuffer[eventPos] = b;
+	eventPos++;
+	return 1;
 }
 
-void SmartTwoWire::writeToBuf(unsigned int b) {
-	frame[framePos] = b >> 8;
-	frame[framePos+1] = b & 0xFF;
-	framePos += 2;
+unsigned char SmartTwoWire::writeToBuf(unsigned int b) {
+	if (eventPos + 2 > SW_EVENT_MAX_LENGTH - 2)
+		return 0;
+	eventBuffer[eventPos] = b >> 8;
+	eventBuffer[eventPos+1] = b & 0xFF;
+	eventPos += 2;
+	return 2;
 }
 
-void SmartTwoWire::writeToBuf(float b) {
+unsigned char SmartTwoWire::writeToBuf(float b) {
+	if (eventPos + 4 > SW_EVENT_MAX_LENGTH - 2)
+		return 0;
     char* floatPtr = (char*) &b;
-	frame[framePos] = floatPtr[0];
-	frame[framePos + 1] = floatPtr[1];
-	frame[framePos + 2] = floatPtr[2];
-	frame[framePos + 3] = floatPtr[3];
-	framePos += 4;
+	eventBuffer[eventPos] = floatPtr[0];
+	eventBuffer[eventPos + 1] = floatPtr[1];
+	eventBuffer[eventPos + 2] = floatPtr[2];
+	eventBuffer[eventPos + 3] = floatPtr[3];
+	eventPos += 4;
+	return 4;
 }
 
-void SmartTwoWire::flush() {
-	frame[2] = framePos - 4;
+unsigned char SmartTwoWire::writeToBuf(const unsigned char* data, unsigned char length) {
+	if (eventPos + length > SW_EVENT_MAX_LENGTH - 2)
+		return 0;
+	for (unsigned char i = 0; i < length; i++)
+		eventBuffer[eventPos + i] = data[i];
+	eventPos += length;
+	return length;
+}
+
+void SmartTwoWire::finishEvent() {
+	eventBuffer[2] = eventPos - 4;
 	
 	unsigned int crc16;
-	crc16 = calculateCRC(frame, framePos);
-	frame[framePos] = crc16 >> 8; // split crc into 2 bytes
-	frame[framePos + 1] = crc16 & 0xFF;
-	framePos += 2;
-	sendPacket(framePos);
+	crc16 = calculateCRC(eventBuffer, eventPos);
+	eventBuffer[eventPos] = crc16 >> 8; // split crc into 2 bytes
+	eventBuffer[eventPos + 1] = crc16 & 0xFF;
+	eventPos += 2;
+	eventSeq++;
+}
+
+// 1 when the finished event fits into one frame
+unsigned char SmartTwoWire::fragmentCount() {
+	if (eventPos <= BUFFER_LENGTH)
+		return 1;
+	return (eventPos + SW_FRAGMENT_PAYLOAD - 1) / SW_FRAGMENT_PAYLOAD;
+}
+
+// Writes fragment number of the finished event to out, returns its length.
+unsigned char SmartTwoWire::buildFragment(unsigned char number, unsigned char* out) {
+	unsigned char offset = number * SW_FRAGMENT_PAYLOAD;
+	unsigned char sliceLength = eventPos - offset;
+	unsigned char last = 0x80;
+	
+	if (sliceLength > SW_FRAGMENT_PAYLOAD) {
+		sliceLength = SW_FRAGMENT_PAYLOAD;
+		last = 0;
+	}
+	out[0] = slaveID;
+	out[1] = SW_FUNCTION_FRAGMENT;
+	out[2] = sliceLength + 1; // length - 6, as for events
+	out[3] = eventSeq;
+	out[4] = number | last;
+	for (unsigned char i = 0; i < sliceLength; i++)
+		out[5 + i] = eventBuffer[offset + i];
+	
+	unsigned int crc16 = calculateCRC(out, sliceLength + 5);
+	out[sliceLength + 5] = crc16 >> 8;
+	out[sliceLength + 6] = crc16 & 0xFF;
+	return sliceLength + 7;
+}
+
+void SmartTwoWire::flush() {
+	finishEvent();
+	unsigned char count = fragmentCount();
+	unsigned char out[BUFFER_LENGTH];
+	
+	if (count == 1) {
+		sendPacket(eventBuffer, eventPos);
+		return;
+	}
+	for (unsigned char n = 0; n < count; n++)
+		sendPacket(out, buildFragment(n, out));
+}
+
+// interrupt context: reports a fragmented event once all its fragments are done
+void SmartTwoWire::onFragmentSent(unsigned char status) {
+	if (status && !fragmentStatus)
+		fragmentStatus = status;
+	if (--fragmentsPending == 0 && fragmentCallback)
+		fragmentCallback(fragmentStatus);
+}
+
+unsigned char SmartTwoWire::enqueue(void (*callback)(unsigned char)) {
+	finishEvent();
+	unsigned char count = fragmentCount();
+	unsigned char out[BUFFER_LENGTH];
+	twi_txQueueStats stats;
+	
+	if (count == 1)
+		return twi_enqueue(0, eventBuffer, eventPos, callback);
+	
+	// all fragments or none: replies queued by the interrupt in between
+	// could otherwise leave the event half sent
+	unsigned char sreg = SREG;
+	cli();
+	twi_getQueueStats(&stats);
+	if (fragmentsPending || TWI_TXQ_LENGTH - stats.depth < count) {
+		SREG = sreg;
+		return 7;
+	}
+	fragmentCallback = callback;
+	fragmentStatus = 0;
+	fragmentsPending = count;
+	for (unsigned char n = 0; n < count; n++)
+		twi_enqueue(0, out, buildFragment(n, out), onFragmentSent);
+	SREG = sreg;
+	return 0;
+}
+
+unsigned char SmartTwoWire::batchReading(unsigned char type, const unsigned char* data, unsigned char length) {
+	// id, function, count, value type 5, record type and length, crc
+	if (length > BUFFER_LENGTH - 8)
+		return 1;
+	if (batchPos && batchPos + 2 + length > BUFFER_LENGTH - 2) {
+		unsigned char status = sendBatch();
+		if (status)
+			return status;
+	}
+	
+	if (batchPos == 0) {
+		batchBuffer[0] = slaveID;
+		batchBuffer[1] = 0x00;
+		batchBuffer[3] = SW_VALUE_BATCH;
+		batchPos = 4;
+		batchStarted = millis();
+	}
+	batchBuffer[batchPos] = type;
+	batchBuffer[batchPos + 1] = length;
+	batchPos += 2;
+	for (unsigned char i = 0; i < length; i++)
+		batchBuffer[batchPos + i] = data[i];
+	batchPos += length;
+	
+	// the reading is taken even if the queue is full now, poll() retries
+	if (batchLinger == 0 || millis() - batchStarted >= batchLinger ||
+		batchPos + 3 > BUFFER_LENGTH - 2)
+		sendBatch();
+	return 0;
+}
+
+unsigned char SmartTwoWire::batchReading(unsigned char type, unsigned char value) {
+	return batchReading(type, &value, 1);
+}
+
+// same byte order as writeToBuf()
+unsigned char SmartTwoWire::batchReading(unsigned char type, unsigned int value) {
+	unsigned char bytes[2];
+	bytes[0] = value >> 8;
+	bytes[1] = value & 0xFF;
+	return batchReading(type, bytes, 2);
+}
+
+unsigned char SmartTwoWire::batchReading(unsigned char type, float value) {
+	return batchReading(type, (unsigned char*) &value, 4);
+}
+
+unsigned char SmartTwoWire::sendBatch() {
+	if (batchPos == 0)
+		return 0;
+	
+	batchBuffer[2] = batchPos - 4;
+	unsigned int crc16 = calculateCRC(batchBuffer, batchPos);
+	batchBuffer[batchPos] = crc16 >> 8;
+	batchBuffer[batchPos + 1] = crc16 & 0xFF;
+	
+	unsigned char status = twi_enqueue(0, batchBuffer, batchPos + 2, 0);
+	if (status == 0)
+		batchPos = 0;
+	return status;
+}
+
+void SmartTwoWire::setBatchLinger(unsigned int ms) {
+	batchLinger = ms;
+}
+
+void SmartTwoWire::setPublishSlot(unsigned char slot, unsigned char slots, unsigned int slotMs) {
+	if (slot >= slots)
+		twi_setTxSlot(0, 0, 0);
+	else
+		twi_setTxSlot(slot * slotMs, slotMs, slots * slotMs);
+}
+
+void SmartTwoWire::watchRegisters(SmartWatch* _watches, unsigned char count) {
+	for (unsigned char i = 0; i < count; i++) {
+		watchedValue(_watches[i].address, &_watches[i].published);
+		_watches[i].publishedAt = millis();
+	}
+	watches = _watches;
+	watchCount = count;
+}
+
+// main loop read of any register, 0 when there is none or it failed
+unsigned char SmartTwoWire::watchedValue(unsigned int address, unsigned int* value) {
+	const SmartBank* bank = findBank(address);
+	
+	if (!bank)
+		return 0;
+	if (bank->kind != SW_BANK_RAM)
+		return readRegister(bank, address, value) == 0;
+	
+	unsigned char sreg = SREG;
+	cli(); // function 16 writes registers from the interrupt
+	*value = bank->regs[address - bank->start];
+	SREG = sreg;
+	return 1;
+}
+
+void SmartTwoWire::publishChanges() {
+	unsigned long now = millis();
+	
+	for (unsigned char i = 0; i < watchCount; i++) {
+		SmartWatch* watch = &watches[i];
+		unsigned int value;
+		if (!watchedValue(watch->address, &value))
+			continue;
+		
+		// the shorter way round, right for signed and unsigned registers
+		int16_t difference = (int16_t)(value - watch->published);
+		uint16_t distance = difference < 0 ? (uint16_t)-difference : difference;
+		if (distance <= watch->deadband || now - watch->publishedAt < watch->minInterval)
+			continue;
+		
+		SmartRegisterChange change;
+		change.address = watch->address;
+		change.value = value;
+		if (batchValue(change))
+			return; // TX queue full, the rest waits for the next poll()
+		watch->published = value;
+		watch->publishedAt = now;
+	}
+}
+
+void SmartTwoWire::pollSlaves(SmartPoll* table, unsigned char count) {
+	unsigned long now = millis();
+	unsigned char sreg = SREG;
+	cli();
+	for (unsigned char i = 0; i < count; i++) {
+		table[i].due = now;
+		table[i].updated = 0;
+		table[i].failures = 0;
+	}
+	pollTable = table;
+	pollCount = count;
+	pollPending = 0;
+	SREG = sreg;
+}
+
+// Interrupts off: from poll() or the receive and TX queue interrupts.
+// Queues the registers readCached() missed or else the read with the
+// earliest deadline among those due.
+void SmartTwoWire::startPoll() {
+	if (registerCacheSize && startCachedRead())
+		return;
+	
+	unsigned long now = millis();
+	SmartPoll* next = 0;
+	unsigned char nextIndex = 0;
+	long nextSlack = 0;
+	
+	for (unsigned char i = 0; i < pollCount; i++) {
+		SmartPoll* entry = &pollTable[i];
+		if ((long)(now - entry->due) < 0)
+			continue;
+		long slack = (long)(entry->due + entry->period - now); // time left to its deadline
+		if (!next || slack < nextSlack || (slack == nextSlack && entry->priority > next->priority)) {
+			next = entry;
+			nextIndex = i;
+			nextSlack = slack;
+		}
+	}
+	if (!next)
+		return;
+	
+	if (sendRead(next->slave, next->start, next->count) == 0) { // else the next poll() tries again
+		pollPending = nextIndex + 1;
+		pollSentAt = now;
+	}
+}
+
+// Interrupts off. Grows the first wanted register into the run of wanted
+// neighbours around it and queues that. Returns 1 when a request was
+// queued.
+unsigned char SmartTwoWire::startCachedRead() {
+	SmartCachedRegister* seed = 0;
+	for (unsigned char i = 0; i < registerCacheSize; i++) {
+		if (registerCache[i].state & SW_REGISTER_WANTED) {
+			seed = &registerCache[i];
+			break;
+		}
+	}
+	if (!seed)
+		return 0;
+	
+	unsigned char slave = seed->slave;
+	unsigned int start = seed->address;
+	unsigned char count = 1;
+	while (count < SW_MAX_READ_REGISTERS && start > 0 && registerWanted(slave, start - 1)) {
+		start--;
+		count++;
+	}
+	while (count < SW_MAX_READ_REGISTERS && start + count - 1 < 0xFFFF && registerWanted(slave, start + count))
+		count++;
+	
+	if (sendRead(slave, start, count))
+		return 0; // TX queue full, the next poll() tries again
+	cacheReadPending = 1;
+	cacheReadSlave = slave;
+	cacheReadStart = start;
+	cacheReadCount = count;
+	pollSentAt = millis();
+	return 1;
+}
+
+// queues a function 3 request, twi_enqueue() status
+unsigned char SmartTwoWire::sendRead(unsigned char slave, unsigned int start, unsigned char count) {
+	unsigned char request[8];
+	request[0] = slave;
+	request[1] = 3;
+	request[2] = start >> 8;
+	request[3] = start & 0xFF;
+	request[4] = 0;
+	request[5] = count;
+	unsigned int crc16 = calculateCRC(request, 6);
+	request[6] = crc16 >> 8;
+	request[7] = crc16 & 0xFF;
+	return twi_enqueue(slave, request, 8, onPollSent);
+}
+
+// interrupt context: the request is out, the timeout starts now, or it
+// failed, e.g. no slave with that ID
+void SmartTwoWire::onPollSent(unsigned char status) {
+	if (!pollPending && !cacheReadPending)
+		return;
+	if (status)
+		SmartWire.finishPoll(0);
+	else {
+		pollSentAt = millis();
+		replyAwaited = addressedReplies;
+	}
+}
+
+#if SW_ENABLE_ADDRESSED_REPLIES
+// Addressed mode: reads the reply to the request on the bus with
+// requestFrom(). The slave sends a 0 first when it is not ready, that is
+// left to the next poll() and finally to SW_POLL_TIMEOUT_MS.
+void SmartTwoWire::fetchReply() {
+	unsigned char slave, count;
+	unsigned char sreg = SREG;
+	cli();
+	if (cacheReadPending) {
+		slave = cacheReadSlave;
+		count = cacheReadCount;
+	}
+	else if (pollPending) {
+		slave = pollTable[pollPending - 1].slave;
+		count = pollTable[pollPending - 1].count;
+	}
+	else {
+		replyAwaited = 0;
+		SREG = sreg;
+		return;
+	}
+	SREG = sreg;
+	
+	unsigned char reply[BUFFER_LENGTH];
+	unsigned char length = requestFrom(slave, (unsigned char)(5 + count * 2));
+	for (unsigned char i = 0; i < length; i++)
+		reply[i] = TwoWire::read();
+	if (length && reply[0] == 0)
+		return;
+	
+	if (length && reply[0] == slave && reply[1] == (3 | 0x80))
+		length = 5; // an exception is shorter than asked for
+	unsigned char valid = length >= 5 && reply[0] == slave;
+	if (valid) {
+		unsigned int crc16 = calculateCRC(reply, length - 2);
+		valid = reply[length - 2] == (crc16 >> 8) && reply[length - 1] == (crc16 & 0xFF);
+	}
+	
+	replyAwaited = 0;
+	if (valid)
+		pollReply(reply, length);
+	else {
+		cli();
+		finishPoll(0); // NACKed or garbled, the response is gone
+		SREG = sreg;
+	}
+}
+#endif
+
+// interrupts off
+void SmartTwoWire::finishPoll(unsigned char success) {
+	replyAwaited = 0;
+	if (cacheReadPending) {
+		cacheReadPending = 0;
+		if (success) {
+			pollsCompleted++;
+		}
+		else {
+			// readCached() asks again once its ttl is over, so a slave that
+			// is gone does not take the bus in every loop()
+			unsigned long now = millis();
+			for (unsigned char i = 0; i < cacheReadCount; i++) {
+				SmartCachedRegister* reg = findRegister(cacheReadSlave, cacheReadStart + i, 0);
+				if (reg) {
+					reg->state = SW_REGISTER_FAILED;
+					reg->updated = now;
+				}
+			}
+			pollsFailed++;
+		}
+		startPoll();
+		return;
+	}
+	
+	SmartPoll* entry = &pollTable[pollPending - 1];
+	unsigned long now = millis();
+	
+	pollPending = 0;
+	if (success) {
+		entry->failures = 0;
+		entry->updated = now;
+		entry->due += entry->period;
+		if ((long)(now - entry->due) > 0)
+			entry->due = now; // fell behind, don't try to catch up
+		pollsCompleted++;
+	}
+	else {
+		if (entry->failures < 255)
+			entry->failures++;
+		unsigned long backoff = (unsigned long)entry->period << (entry->failures < 12 ? entry->failures : 12);
+		if (backoff > SW_POLL_MAX_BACKOFF_MS)
+			backoff = SW_POLL_MAX_BACKOFF_MS;
+		entry->due = now + backoff;
+		pollsFailed++;
+	}
+	startPoll();
+}
+
+// a function 3 reply or exception seen by general call, maybe ours
+void SmartTwoWire::pollReply(unsigned char* buffer, unsigned char bufferLength) {
+	unsigned char sreg = SREG;
+	cli(); // poll() in deferred mode, the TX queue callback may interrupt
+	if (cacheReadPending) {
+		if (buffer[0] == cacheReadSlave) {
+			if (buffer[1] == 3 && buffer[2] == cacheReadCount * 2 && bufferLength == buffer[2] + 5) {
+				unsigned long now = millis();
+				for (unsigned char i = 0; i < cacheReadCount; i++) {
+					SmartCachedRegister* reg = findRegister(cacheReadSlave, cacheReadStart + i, 0);
+					if (!reg)
+						continue; // replaced since, and no longer wanted
+					reg->value = (buffer[3 + 2 * i] << 8) | buffer[4 + 2 * i];
+					reg->updated = now;
+					reg->state = SW_REGISTER_VALID;
+				}
+				finishPoll(1);
+			}
+			else if (buffer[1] == (3 | 0x80))
+				finishPoll(0);
+		}
+	}
+	else if (pollPending) {
+		SmartPoll* entry = &pollTable[pollPending - 1];
+		if (buffer[0] == entry->slave) {
+			if (buffer[1] == 3 && buffer[2] == entry->count * 2 && bufferLength == buffer[2] + 5) {
+				for (unsigned char i = 0; i < entry->count; i++)
+					entry->values[i] = (buffer[3 + 2 * i] << 8) | buffer[4 + 2 * i];
+				finishPoll(1);
+			}
+			else if (buffer[1] == (3 | 0x80))
+				finishPoll(0);
+		}
+	}
+	SREG = sreg;
+}
+
+// Producer side, never touches readingsTail. Returns where length bytes
+// of the new record can be written in place, or 0 when the ring is full.
+// Nothing is visible to the reader until commitEvent().
+unsigned char* SmartTwoWire::reserveEvent(unsigned char length)
+{
+	unsigned int head = readingsHead;
+	unsigned int tail = readingsTail;
+	unsigned int need = length + 1;
+	unsigned int start = head;
+	
+	// head may only catch up with tail when the ring is empty
+	if (head >= tail) {
+		if (SW_READINGS_BUFFER_SIZE - head < need + (tail == 0)) {
+			if (tail <= need) {
+				droppedEvents++; // full, keep the unread events and drop the new one
+				return 0;
+			}
+			start = 0;
+		}
+	}
+	else if (tail - head <= need) {
+		droppedEvents++;
+		return 0;
+	}
+	
+	reservedStart = start;
+	readingsBuffer[start] = length;
+	return &readingsBuffer[start + 1];
+}
+
+void SmartTwoWire::commitEvent()
+{
+	unsigned char head = readingsHead;
+	if (reservedStart != head)
+		readingsBuffer[head] = 0; // wrap marker, the record went to the start
+	
+	unsigned int next = reservedStart + 1 + readingsBuffer[reservedStart];
+	if (next == SW_READINGS_BUFFER_SIZE)
+		next = 0;
+	
+	SW_BARRIER(); // record must be written before it is published
+	readingsHead = next;
+	eventsStored++;
+}
+
+unsigned char SmartTwoWire::storeEvent(unsigned char* buffer, unsigned char bufferLength)
+{
+	if (valueCacheSize)
+		cacheValues(buffer, bufferLength);
+	
+	unsigned char* record = reserveEvent(bufferLength);
+	if (!record)
+		return 0;
+	
+	for (unsigned char i = 0; i < bufferLength; i++)
+		record[i] = buffer[i];
+	commitEvent();
+	return 1;
+}
+
+void SmartTwoWire::setValueCache(SmartCachedValue* entries, unsigned char size)
+{
+	unsigned char sreg = SREG;
+	cli();
+	for (unsigned char i = 0; i < size; i++)
+		entries[i].sender = 0;
+	valueCache = entries;
+	valueCacheSize = size;
+	SREG = sreg;
+}
+
+// Linear probing from the key's home entry. With insert set an unused
+// entry is taken for a new key, or the home entry when none is left.
+SmartCachedValue* SmartTwoWire::findValue(unsigned char sender, unsigned char type, unsigned char id, unsigned char insert)
+{
+	unsigned char home = (unsigned int)(sender * 31 + type * 7 + id) % valueCacheSize;
+	unsigned char i = home;
+	SmartCachedValue* entry;
+	
+	do {
+		entry = &valueCache[i];
+		if (entry->sender == 0)
+			break;
+		if (entry->sender == sender && entry->type == type && entry->id == id)
+			return entry;
+		if (++i == valueCacheSize)
+			i = 0;
+	} while (i != home);
+	
+	if (!insert)
+		return 0;
+	if (entry->sender != 0)
+		entry = &valueCache[home]; // full
+	entry->sender = sender;
+	entry->type = type;
+	entry->id = id;
+	entry->length = 0;
+	entry->changed = 1;
+	return entry;
+}
+
+// receive path, every event goes through here before it is stored
+void SmartTwoWire::cacheValues(unsigned char* buffer, unsigned char bufferLength)
+{
+	SmartReadings readings(buffer, bufferLength);
+	const unsigned char* payload;
+	unsigned char type, length;
+	unsigned long now = millis();
+	
+	while ((payload = readings.next(&type, &length)) != 0) {
+		if (length > SW_VALUE_CACHE_PAYLOAD)
+			continue;
+		unsigned char id = 0;
+		if (length > SW_VALUE_ID_OFFSET(type) && SW_HAS_VALUE_ID(type))
+			id = payload[SW_VALUE_ID_OFFSET(type)];
+		
+		SmartCachedValue* entry = findValue(buffer[0], type, id, 1);
+		unsigned char changed = entry->length != length;
+		
+		for (unsigned char i = 0; i < length; i++) {
+			if (entry->value[i] != payload[i]) {
+				entry->value[i] = payload[i];
+				changed = 1;
+			}
+		}
+		entry->length = length;
+		entry->updated = now;
+		if (changed)
+			entry->changed = 1;
+	}
+}
+
+unsigned char SmartTwoWire::readValue(unsigned char sender, unsigned char type, unsigned char id, SmartCachedValue* out)
+{
+	unsigned char found = 0;
+	unsigned char sreg = SREG;
+	cli(); // the receive interrupt updates entries
+	if (valueCacheSize) {
+		SmartCachedValue* entry = findValue(sender, type, id, 0);
+		if (entry) {
+			*out = *entry;
+			entry->changed = 0;
+			found = 1;
+		}
+	}
+	SREG = sreg;
+	return found;
+}
+
+void SmartTwoWire::setRegisterCache(SmartCachedRegister* entries, unsigned char size)
+{
+	for (unsigned char i = 0; i < size; i++)
+		entries[i].slave = 0;
+	unsigned char sreg = SREG;
+	cli();
+	registerCache = entries;
+	registerCacheSize = size;
+	cacheReadPending = 0;
+	SREG = sreg;
+}
+
+// Open addressing with linear probing, as findValue(). Adjacent registers
+// land in adjacent entries.
+SmartCachedRegister* SmartTwoWire::findRegister(unsigned char slave, unsigned int address, unsigned char insert)
+{
+	unsigned char home = (unsigned int)(slave * 31 + address) % registerCacheSize;
+	unsigned char i = home;
+	SmartCachedRegister* entry;
+	
+	do {
+		entry = &registerCache[i];
+		if (entry->slave == 0)
+			break;
+		if (entry->slave == slave && entry->address == address)
+			return entry;
+		if (++i == registerCacheSize)
+			i = 0;
+	} while (i != home);
+	
+	if (!insert)
+		return 0;
+	if (entry->slave != 0)
+		entry = &registerCache[home]; // full
+	entry->slave = slave;
+	entry->address = address;
+	entry->state = 0;
+	return entry;
+}
+
+unsigned char SmartTwoWire::registerWanted(unsigned char slave, unsigned int address)
+{
+	SmartCachedRegister* reg = findRegister(slave, address, 0);
+	return reg && (reg->state & SW_REGISTER_WANTED);
+}
+
+unsigned char SmartTwoWire::readCached(unsigned char slave, unsigned int start, unsigned char count,
+	unsigned int* values, unsigned int ttl)
+{
+	unsigned long now = millis();
+	unsigned char fresh = registerCacheSize != 0;
+	unsigned char sreg = SREG;
+	cli(); // replies fill entries from the interrupt
+	for (unsigned char i = 0; i < count && registerCacheSize; i++) {
+		SmartCachedRegister* reg = findRegister(slave, start + i, 1);
+		if ((reg->state & SW_REGISTER_VALID) && now - reg->updated < ttl) {
+			values[i] = reg->value;
+		}
+		else {
+			if (!(reg->state & SW_REGISTER_FAILED) || now - reg->updated >= ttl)
+				reg->state |= SW_REGISTER_WANTED;
+			fresh = 0;
+		}
+	}
+	SREG = sreg;
+	
+	if (fresh)
+		cacheHits++;
+	else
+		cacheMisses++;
+	return fresh;
 }
 
 int SmartTwoWire::available() {
-	return isDataAvailable;
+	return (unsigned char)(eventsStored - eventsReleased);
 }
 
-SmartData SmartTwoWire::readBuffer() {
-	SmartData result = readingsBuffer[currentBufferIndex];
+const unsigned char* SmartTwoWire::peek(unsigned char* length) {
+	unsigned char tail = readingsTail;
+	if (tail == readingsHead)
+		return 0;
+	SW_BARRIER();
+	
+	if (readingsBuffer[tail] == 0) { // wrap marker, record continues at the start
+		tail = 0;
+		readingsTail = 0;
+	}
+	
+	if (length)
+		*length = readingsBuffer[tail];
+	return &readingsBuffer[tail + 1];
+}
+
+void SmartTwoWire::release() {
+	if (!peek(0)) // also steps over a wrap marker
+		return;
+	
+	unsigned int tail = readingsTail + 1 + readingsBuffer[readingsTail];
+	if (tail == SW_READINGS_BUFFER_SIZE)
+		tail = 0;
 	
-	if (currentBufferIndex == assignedBufferIndex)
-		isDataAvailable = 0;
+	SW_BARRIER(); // finish reading the record before handing it back
+	readingsTail = tail;
+	eventsReleased++;
+}
+
+SmartData SmartTwoWire::readBuffer() {
+	SmartData result;
+	const unsigned char* buffer = peek(&result.length);
 	
-	currentBufferIndex++;
-	if (currentBufferIndex >= 20)
-		currentBufferIndex = 0;
+	if (buffer) {
+		if (result.length > BUFFER_LENGTH)
+			result.length = BUFFER_LENGTH;
+		for (unsigned char i = 0; i < result.length; i++)
+			result.buffer[i] = buffer[i];
+		release();
+	}
+	else
+		result.length = 0;
 		
 	return result;
 }
 
+SmartReadings::SmartReadings(const unsigned char* event, unsigned char length)
+{
+	// [id][0][count][value type] ... [crc][crc]
+	if (length < 6) {
+		pos = end = event;
+		single = 0;
+		return;
+	}
+	single = event[3] != SW_VALUE_BATCH;
+	pos = single ? event + 3 : event + 4;
+	end = event + length - 2;
+}
+
+SmartReadings::SmartReadings(const SmartData& data)
+{
+	*this = SmartReadings(data.buffer, data.length);
+}
+
+const unsigned char* SmartReadings::next(unsigned char* type, unsigned char* length)
+{
+	const unsigned char* payload;
+	
+	if (pos >= end)
+		return 0;
+	if (single) {
+		*type = pos[0];
+		*length = end - pos - 1;
+		payload = pos + 1;
+		pos = end;
+		return payload;
+	}
+	if (end - pos < 2 || pos[1] > end - pos - 2) {
+		pos = end; // record cut short, the batch is malformed
+		return 0;
+	}
+	*type = pos[0];
+	*length = pos[1];
+	payload = pos + 2;
+	pos = payload + pos[1];
+	return payload;
+}
+
 SmartTwoWire SmartWire = SmartTwoWire();
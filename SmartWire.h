@@ -7,6 +7,33 @@ Event structure (Based on modbus)
  X - data
  X+1, X+2 - message CRC
  
+ Events longer than BUFFER_LENGTH are sent as fragments (command 65)
+ carrying consecutive slices of the complete event frame, CRC included:
+ 0 - Sender ID
+ 1 - Command (65 - event fragment)
+ 2 - slice length X + 2
+ 3 - event sequence number, the same for all fragments of one event
+ 4 - fragment number (bits 0-6), bit 7 set on the last fragment
+ X - slice
+ X+1, X+2 - fragment CRC
+ The receiver puts the slices back together and stores the event as if
+ it had arrived in one frame.
+ 
+ Reliable events (command 66, see enqueueReliable()) fit one frame:
+ 0 - Sender ID
+ 1 - Command (66 - reliable event)
+ 2 - data length X + 2
+ 3 - sequence number (bits 0-6), bit 7 set until the sender's first ack
+ 4 - oldest sequence number the sender has not given up on
+ X - data
+ X+1, X+2 - message CRC
+ and are stored as command 0 events. Receivers answer each with an ack
+ written to the sender's own address:
+ 0 - Receiver ID
+ 1 - Command (67 - ack)
+ 2 - sequence number the receiver expects next
+ 3, 4 - message CRC
+ 
  Data:
  First byte defines value type:
   0 - other
@@ -20,6 +47,20 @@ Event structure (Based on modbus)
       4.4 (float) - Vrms
       4.5 (float) - Irms
       4.6 (float) - total kWh consumed per sensor
+  5 - batch of readings, each [value type][payload length][payload],
+      see batchReading() and SmartReadings
+  6 - temperature, fixed point (int16 hundredths of a degree)
+  7 - electricity, fixed point
+      7.1 (byte) - sensor no
+      7.2 (int32) - real power in mW
+      7.3 (int16) - power factor * 1000
+      7.4 (uint16) - Vrms * 100
+      7.5 (uint16) - Irms in mA
+      7.6 (uint32) - total Wh consumed per sensor
+  8 - holding register change (uint16 address, uint16 value), see
+      watchRegisters()
+ Integers in types 6 to 8 are little endian, the byte order floats are
+ sent in. Types 1 to 4 and 6 to 8 have typed layouts in SmartValues.h.
  */
 
 
@@ -39,11 +80,15 @@ Event structure (Based on modbus)
  SimpleModbusSlave implements an unsigned int return value on a call to modbus_update().
  This value is the total error count since the slave started. It's useful for fault finding.
  
- This code is for a Modbus slave implementing functions 3 and 16
+ This code is for a Modbus slave implementing functions 3, 6, 16 and 23
  function 3: Reads the binary contents of holding registers (4X references)
+ function 6: Presets a single holding register (4X reference)
  function 16: Presets values into a sequence of holding registers (4X references)
+ function 23: Presets a sequence of holding registers, then reads a
+ sequence in the same transaction (4X references)
  
- All the functions share the same register array.
+ All the functions share the same register array, or the same set of
+ register banks (see SmartBank) that maps a sparse address space.
  
  Note:  
  The Arduino serial ring buffer is 128 bytes or 64 registers.
@@ -74,47 +119,628 @@ Event structure (Based on modbus)
 #define SmartWire_h
 
 #include "Wire.h"
+#include "SmartCRC.h"
+#include "SmartValues.h"
+
+extern "C" {
+  #include "utility/twi.h"
+}
+
+// bytes of storage for received events, each takes its frame length + 1
+#ifndef SW_READINGS_BUFFER_SIZE
+#define SW_READINGS_BUFFER_SIZE 256
+#endif
+
+// fragmented events that can be reassembled at the same time, one per
+// sender, SW_EVENT_MAX_LENGTH + 8 bytes each; 0 NACKs fragments and
+// keeps events to one frame
+#ifndef SW_REASSEMBLY_SLOTS
+#define SW_REASSEMBLY_SLOTS 2
+#endif
+
+// longest event beginEvent()/writeToBuf() can build, header and CRC
+// included; anything over BUFFER_LENGTH goes out in fragments
+#ifndef SW_EVENT_MAX_LENGTH
+#if SW_REASSEMBLY_SLOTS
+#define SW_EVENT_MAX_LENGTH 64
+#else
+#define SW_EVENT_MAX_LENGTH BUFFER_LENGTH
+#endif
+#endif
+
+// a partly received event is dropped when its next fragment is this late
+#ifndef SW_REASSEMBLY_TIMEOUT_MS
+#define SW_REASSEMBLY_TIMEOUT_MS 100
+#endif
+
+// how long batchReading() may hold a reading before the batch is sent
+#ifndef SW_BATCH_LINGER_MS
+#define SW_BATCH_LINGER_MS 20
+#endif
+
+// largest payload the value cache keeps, the electricity layout
+#ifndef SW_VALUE_CACHE_PAYLOAD
+#define SW_VALUE_CACHE_PAYLOAD 21
+#endif
+
+// value IDs setEventFilter() can be limited to
+#ifndef SW_FILTER_IDS
+#define SW_FILTER_IDS 4
+#endif
+
+// a polled slave that has not answered by then has failed
+#ifndef SW_POLL_TIMEOUT_MS
+#define SW_POLL_TIMEOUT_MS 20
+#endif
+
+// longest wait before a slave that keeps failing is tried again
+#ifndef SW_POLL_MAX_BACKOFF_MS
+#define SW_POLL_MAX_BACKOFF_MS 5000
+#endif
+
+// reliable events (enqueueReliable()), sending and receiving: the window
+// alone takes about 150 bytes. Without them command 66 and 67 are NACKed.
+// Arduino builds the library without the sketch's defines, set it here
+// or with a build flag on every node that sends or receives them.
+#ifndef SW_ENABLE_RELIABLE
+#define SW_ENABLE_RELIABLE 0
+#endif
+
+// addressed replies (setAddressedReplies()), a BUFFER_LENGTH response;
+// 0 leaves them out
+#ifndef SW_ENABLE_ADDRESSED_REPLIES
+#define SW_ENABLE_ADDRESSED_REPLIES 1
+#endif
+
+// reliable events in flight per sender, a power of two up to 8
+#ifndef SW_RELIABLE_WINDOW
+#define SW_RELIABLE_WINDOW 4
+#endif
+
+// nodes whose acks setReliablePeers() can wait for
+#ifndef SW_RELIABLE_PEERS
+#define SW_RELIABLE_PEERS 4
+#endif
+
+// senders of reliable events a receiver keeps sequence numbers for
+#ifndef SW_RELIABLE_SENDERS
+#define SW_RELIABLE_SENDERS 4
+#endif
+
+// retransmissions before the oldest reliable event is given up
+#ifndef SW_RELIABLE_RETRIES
+#define SW_RELIABLE_RETRIES 8
+#endif
+
+// retransmission timeout before the first round trip is measured, and
+// the range the measured one is kept in
+#ifndef SW_RELIABLE_INITIAL_RTO_MS
+#define SW_RELIABLE_INITIAL_RTO_MS 100
+#endif
+#ifndef SW_RELIABLE_MIN_RTO_MS
+#define SW_RELIABLE_MIN_RTO_MS 10
+#endif
+#ifndef SW_RELIABLE_MAX_RTO_MS
+#define SW_RELIABLE_MAX_RTO_MS 2000
+#endif
+
+// registers in one read response, as much as fits a frame
+#define SW_MAX_READ_REGISTERS ((BUFFER_LENGTH - 5) / 2)
+
+// largest value type payload, one that fits a frame as the value of an
+// event, a batch record and a reliable event alike
+#define SW_MAX_VALUE_PAYLOAD (BUFFER_LENGTH - 8)
+
+#define SW_VALUE_BATCH 5
+#define SW_FUNCTION_FRAGMENT 65 // first of the Modbus user defined function codes
+#define SW_FRAGMENT_PAYLOAD (BUFFER_LENGTH - 7) // slice bytes per fragment
+#define SW_FUNCTION_RELIABLE 66
+#define SW_FUNCTION_ACK 67
+#define SW_SEQ_DISTANCE(to, from) (((to) - (from)) & 0x7F) // reliable event numbers are 7 bit
+
+// raw frames held for poll() in deferred mode (setDeferred()), a power
+// of two, BUFFER_LENGTH + 2 bytes each; 0 leaves deferred mode out
+#ifndef SW_RX_QUEUE_LENGTH
+#define SW_RX_QUEUE_LENGTH 2
+#endif
+
+#if SW_EVENT_MAX_LENGTH < BUFFER_LENGTH || SW_EVENT_MAX_LENGTH > 255
+#error "SW_EVENT_MAX_LENGTH must be between BUFFER_LENGTH and 255"
+#endif
+#if SW_EVENT_MAX_LENGTH > BUFFER_LENGTH && !SW_REASSEMBLY_SLOTS
+#error "events longer than BUFFER_LENGTH are sent in fragments, which need SW_REASSEMBLY_SLOTS"
+#endif
+#if (SW_EVENT_MAX_LENGTH + SW_FRAGMENT_PAYLOAD - 1) / SW_FRAGMENT_PAYLOAD > TWI_TXQ_LENGTH
+#error "the fragments of the longest event must fit into the TX queue (TWI_TXQ_LENGTH)"
+#endif
+#if SW_READINGS_BUFFER_SIZE > 256 || SW_READINGS_BUFFER_SIZE < 2 * (SW_EVENT_MAX_LENGTH + 1)
+#error "SW_READINGS_BUFFER_SIZE must be between 2 * (SW_EVENT_MAX_LENGTH + 1) and 256"
+#endif
+#if (SW_RX_QUEUE_LENGTH & (SW_RX_QUEUE_LENGTH - 1)) || SW_RX_QUEUE_LENGTH > 128
+#error "SW_RX_QUEUE_LENGTH must be 0 or a power of two no larger than 128"
+#endif
+#if (SW_RELIABLE_WINDOW & (SW_RELIABLE_WINDOW - 1)) || SW_RELIABLE_WINDOW > 8
+#error "SW_RELIABLE_WINDOW must be a power of two no larger than 8"
+#endif
 
-#define SW_READINGS_BUFFER_LENGTH 20
+// keeps the compiler from moving buffer accesses across index updates
+#define SW_BARRIER() __asm__ __volatile__ ("" ::: "memory")
 
 typedef struct {
 	unsigned char buffer[BUFFER_LENGTH];
 	unsigned char length;
 } SmartData;
 
+// a verified frame waiting for poll() in deferred mode
+typedef struct {
+	SmartData data;
+	unsigned char generalCall;
+} SmartFrame;
+
+// newest reading of one value, see setValueCache()
+typedef struct {
+	unsigned char sender; // 0 when the entry is unused
+	unsigned char type;
+	unsigned char id;     // ID byte of SW_HAS_VALUE_ID() types, else 0
+	unsigned char length;
+	unsigned char changed; // differs from what readValue() returned last
+	unsigned long updated; // millis() when it was received
+	unsigned char value[SW_VALUE_CACHE_PAYLOAD];
+} SmartCachedValue;
+
+#define SW_BANK_RAM 0      // regs, read and write
+#define SW_BANK_PROGMEM 1  // progmem, read only: writes get exception 2
+#define SW_BANK_CALLBACK 2 // access() is called for every register
+
+// count holding registers from Modbus address start. access() gets
+// write 0 to fill in *value or 1 to take it, and returns 0 or the
+// exception code to answer with; it may run in interrupt context.
+typedef struct {
+	unsigned int start;
+	unsigned int count;
+	unsigned char kind;
+	unsigned int* regs;
+	const unsigned int* progmem;
+	unsigned char (*access)(unsigned int address, unsigned int* value, unsigned char write);
+} SmartBank;
+
+// a holding register published when it changes, see watchRegisters()
+typedef struct {
+	unsigned int address;
+	unsigned int deadband;    // change it takes to be published again
+	unsigned int minInterval; // ms between two publications
+	unsigned int published;   // value last published
+	unsigned long publishedAt; // millis()
+} SmartWatch;
+
+// one line of the master poll table, see pollSlaves()
+typedef struct {
+	unsigned char slave;
+	unsigned int start;
+	unsigned char count;     // registers, at most SW_MAX_READ_REGISTERS
+	unsigned int period;     // ms between reads
+	unsigned char priority;  // the higher one goes first when deadlines tie
+	unsigned int* values;    // receives the count registers
+	// kept by SmartWire
+	unsigned long due;       // millis() of the next read
+	unsigned long updated;   // millis() of the last good read, 0 before
+	unsigned char failures;  // reads failed in a row
+} SmartPoll;
+
+#define SW_REGISTER_VALID 1  // value holds a read
+#define SW_REGISTER_WANTED 2 // missed by readCached(), in the next request
+#define SW_REGISTER_FAILED 4 // the read failed at updated, not asked for again for ttl ms
+
+// one holding register of a slave in the master read cache, see
+// setRegisterCache()
+typedef struct {
+	unsigned char slave;   // 0 when the entry is unused
+	unsigned char state;   // SW_REGISTER_ flags
+	unsigned int address;
+	unsigned int value;
+	unsigned long updated; // millis() of the read
+} SmartCachedRegister;
+
+// the counters below SmartTwoWire::errorCount, see getStats()
+typedef struct {
+	unsigned int errorCount;
+#if SW_RX_QUEUE_LENGTH
+	unsigned int droppedFrames;
+#endif
+	unsigned long receiveMaxMicros;
+	unsigned int droppedEvents;
+	unsigned int filteredEvents;
+#if SW_ENABLE_RELIABLE
+	unsigned int duplicateEvents;
+	unsigned int reliableRetransmits;
+	unsigned int reliableLost;
+#endif
+	unsigned int pollsCompleted;
+	unsigned int pollsFailed;
+	unsigned int cacheHits;
+	unsigned int cacheMisses;
+} SmartStats;
+
+// where a receiver is in the reliable events of one sender
+typedef struct {
+	unsigned char sender;   // 0 when the entry is unused
+	unsigned char expected; // sequence number of the next event to store
+	unsigned char syncing;  // the last event had the sync bit set
+	unsigned char ackOwed;  // received since the last ack went out
+} SmartReliableSender;
+
+// an event coming in fragments, see reassemble()
+typedef struct {
+	unsigned char next; // fragment number expected next, 0 when the slot is free
+	unsigned char sender;
+	unsigned char seq;
+	unsigned char length;
+	unsigned long updated; // millis() at the latest fragment
+	unsigned char buffer[SW_EVENT_MAX_LENGTH];
+} SmartReassembly;
+
+// Walks the readings of a received event in place: each record of a
+// batch (value type 5), or the single reading of any other event.
+class SmartReadings
+{
+	private:
+		const unsigned char* pos;
+		const unsigned char* end;
+		unsigned char single;
+	public:
+		SmartReadings(const unsigned char* event, unsigned char length);
+		SmartReadings(const SmartData& data);
+		// payload of the next reading, 0 when there are no more
+		const unsigned char* next(unsigned char* type, unsigned char* length);
+};
+
 class SmartTwoWire: public TwoWire
 {
 	private:
-		static unsigned int holdingRegsSize; // size of the register array
-		static unsigned int* regs; // user array address
-		static unsigned char broadcastFlag;
-		static unsigned char slaveID;
-		static unsigned char function;
-		static unsigned char framePos;
-		static SmartData readingsBuffer[SW_READINGS_BUFFER_LENGTH];
-		static unsigned char assignedBufferIndex;
-		static unsigned char currentBufferIndex;
-		static unsigned char isDataAvailable;
-        static void (*user_onEventReceive)(void);
-		static void onDataReceived(int);
+		static TWI_NODE_LOCAL const SmartBank* banks;
+		static TWI_NODE_LOCAL unsigned char bankCount;
+		static TWI_NODE_LOCAL SmartBank arrayBank;
+		static TWI_NODE_LOCAL unsigned char broadcastFlag;
+		static TWI_NODE_LOCAL unsigned char slaveID;
+		static TWI_NODE_LOCAL unsigned char function;
+		static TWI_NODE_LOCAL unsigned char eventBuffer[SW_EVENT_MAX_LENGTH];
+		static TWI_NODE_LOCAL unsigned char eventPos;
+		static TWI_NODE_LOCAL unsigned char eventSeq;
+#if SW_REASSEMBLY_SLOTS
+		static TWI_NODE_LOCAL SmartReassembly reassembly[SW_REASSEMBLY_SLOTS];
+#endif
+		static TWI_NODE_LOCAL unsigned char batchBuffer[BUFFER_LENGTH];
+		static TWI_NODE_LOCAL unsigned char batchPos; // 0 when no batch is open
+		static TWI_NODE_LOCAL unsigned long batchStarted;
+		static TWI_NODE_LOCAL unsigned int batchLinger;
+		static TWI_NODE_LOCAL SmartCachedValue* valueCache;
+		static TWI_NODE_LOCAL unsigned char valueCacheSize;
+		static TWI_NODE_LOCAL SmartWatch* watches;
+		static TWI_NODE_LOCAL unsigned char watchCount;
+		static TWI_NODE_LOCAL SmartPoll* pollTable;
+		static TWI_NODE_LOCAL unsigned char pollCount;
+		static TWI_NODE_LOCAL volatile unsigned char pollPending; // table index + 1 of the read on the bus
+		static TWI_NODE_LOCAL unsigned long pollSentAt;
+		static TWI_NODE_LOCAL SmartCachedRegister* registerCache;
+		static TWI_NODE_LOCAL unsigned char registerCacheSize;
+		static TWI_NODE_LOCAL volatile unsigned char cacheReadPending; // a readCached() request is on the bus
+		static TWI_NODE_LOCAL unsigned char cacheReadSlave;
+		static TWI_NODE_LOCAL unsigned int cacheReadStart;
+		static TWI_NODE_LOCAL unsigned char cacheReadCount;
+#if SW_ENABLE_RELIABLE
+		// reliable events sent, see enqueueReliable()
+		static TWI_NODE_LOCAL SmartData reliableFrames[SW_RELIABLE_WINDOW];
+		static TWI_NODE_LOCAL unsigned long reliableSentAt[SW_RELIABLE_WINDOW];
+		static TWI_NODE_LOCAL unsigned char reliableRetransmitted; // bit per frame, no round trip sample
+		static TWI_NODE_LOCAL unsigned char reliableBase; // oldest not acked
+		static TWI_NODE_LOCAL unsigned char reliableNext;
+		static TWI_NODE_LOCAL unsigned char reliableRetries;
+		static TWI_NODE_LOCAL unsigned char reliableSynced; // acked once since begin()
+		static TWI_NODE_LOCAL unsigned int reliableSrtt;   // smoothed round trip ms * 8, 0 before the first
+		static TWI_NODE_LOCAL unsigned int reliableRttvar; // its mean deviation ms * 4
+		static TWI_NODE_LOCAL unsigned int reliableRto;
+		static TWI_NODE_LOCAL unsigned char reliablePeers[SW_RELIABLE_PEERS];
+		static TWI_NODE_LOCAL unsigned char reliableAcked[SW_RELIABLE_PEERS]; // next expected by each peer
+		static TWI_NODE_LOCAL unsigned char reliablePeerCount;
+		// reliable events received
+		static TWI_NODE_LOCAL SmartReliableSender reliableSenders[SW_RELIABLE_SENDERS];
+		static TWI_NODE_LOCAL unsigned char reliableSenderNext; // entry taken by the next new sender
+		static TWI_NODE_LOCAL volatile unsigned char ackInFlight; // reliableSenders index + 1 of the queued ack
+		static TWI_NODE_LOCAL unsigned char ackAttempts;
+#endif
+		// addressed replies, see setAddressedReplies()
+		static TWI_NODE_LOCAL unsigned char addressedReplies;
+#if SW_ENABLE_ADDRESSED_REPLIES
+		static TWI_NODE_LOCAL unsigned char response[BUFFER_LENGTH];
+		static TWI_NODE_LOCAL volatile unsigned char responseLength; // 0 while none is ready
+#endif
+		static TWI_NODE_LOCAL volatile unsigned char replyAwaited; // request sent, poll() reads the reply
+		// enqueue() of a fragmented event, see onFragmentSent()
+		static TWI_NODE_LOCAL void (*fragmentCallback)(unsigned char);
+		static TWI_NODE_LOCAL volatile unsigned char fragmentsPending;
+		static TWI_NODE_LOCAL unsigned char fragmentStatus;
+		static TWI_NODE_LOCAL unsigned char readingsBuffer[SW_READINGS_BUFFER_SIZE];
+		static TWI_NODE_LOCAL volatile unsigned char readingsHead;
+		static TWI_NODE_LOCAL volatile unsigned char readingsTail;
+		static TWI_NODE_LOCAL volatile unsigned char eventsStored;
+		static TWI_NODE_LOCAL volatile unsigned char eventsReleased;
+#if SW_RX_QUEUE_LENGTH
+		static TWI_NODE_LOCAL SmartFrame rxQueue[SW_RX_QUEUE_LENGTH];
+		static TWI_NODE_LOCAL volatile unsigned char rxQueueHead;
+		static TWI_NODE_LOCAL volatile unsigned char rxQueueTail;
+		static TWI_NODE_LOCAL unsigned char deferred;
+#endif
+        static TWI_NODE_LOCAL void (*user_onEventReceive)(void);
+		static TWI_NODE_LOCAL unsigned char reservedStart;
+		// streaming parser state, see onDataByte()
+		static TWI_NODE_LOCAL SmartCRC rxCrc;
+		static TWI_NODE_LOCAL unsigned char rxLength;
+		static TWI_NODE_LOCAL unsigned char rxFunction;
+		static TWI_NODE_LOCAL unsigned char rxCrcHigh;
+		static TWI_NODE_LOCAL unsigned char rxStatus;
+		static TWI_NODE_LOCAL unsigned char rxGeneralCall;
+		static TWI_NODE_LOCAL unsigned char rxSender;
+		static TWI_NODE_LOCAL unsigned char rxValueType;
+		static TWI_NODE_LOCAL unsigned char rxTypeIndex; // where an event's value type is, 0 if not an event
+		// subscription, see setEventFilter()
+		static TWI_NODE_LOCAL unsigned char filterSenderMask;
+		static TWI_NODE_LOCAL unsigned char filterSenderMatch;
+		static TWI_NODE_LOCAL unsigned long filterTypes;
+		static TWI_NODE_LOCAL unsigned char filterIds[SW_FILTER_IDS];
+		static TWI_NODE_LOCAL unsigned char filterIdCount;
+		static unsigned char onDataByte(unsigned char, unsigned char, unsigned char);
+		static unsigned char rejectFrame();
+		static unsigned char filterFrame();
+		static void onDataReceived(unsigned char*, int);
 		static void onEventReceived(unsigned char);
+		static void onFragmentSent(unsigned char);
+		static void onPollSent(unsigned char);
+		void sendReply(unsigned char bufferSize);
+#if SW_ENABLE_ADDRESSED_REPLIES
+		static void onResponseRequested();
+		void fetchReply();
+#endif
+		void startPoll();
+		unsigned char startCachedRead();
+		unsigned char sendRead(unsigned char slave, unsigned int start, unsigned char count);
+		SmartCachedRegister* findRegister(unsigned char slave, unsigned int address, unsigned char insert);
+		unsigned char registerWanted(unsigned char slave, unsigned int address);
+		void finishPoll(unsigned char success);
+		void pollReply(unsigned char* buffer, unsigned char bufferLength);
 		void exceptionResponse(unsigned char exception);
-		void readData(int);
+		const SmartBank* findBank(unsigned int address);
+		unsigned char checkRange(unsigned int start, unsigned int count, unsigned int maxCount,
+			unsigned char write, const SmartBank** bank);
+		unsigned char readRegister(const SmartBank* bank, unsigned int address, unsigned int* value);
+		unsigned char replyRegisters(const SmartBank* bank, unsigned int start, unsigned int count);
+		unsigned char writeRegisters(const SmartBank* bank, unsigned int start, unsigned int count, const unsigned char* data);
+		unsigned char watchedValue(unsigned int address, unsigned int* value);
+		void finishEvent();
+		unsigned char fragmentCount();
+		unsigned char buildFragment(unsigned char number, unsigned char* out);
+		void sendPacket(const unsigned char* data, unsigned char bufferSize);
+#if SW_REASSEMBLY_SLOTS
+		void reassemble(unsigned char* buffer, unsigned char bufferLength);
+#endif
+#if SW_ENABLE_RELIABLE
+		unsigned char sendReliable(unsigned char seq);
+		void retransmitReliable();
+		void reliableAck(unsigned char from, unsigned char next);
+		void sampleRoundTrip(unsigned long ms);
+		unsigned int estimatedRto();
+		void receiveReliable(unsigned char* buffer, unsigned char bufferLength);
+		static void onAckSent(unsigned char);
+		void sendAck();
+#endif
+		void cacheValues(unsigned char* buffer, unsigned char bufferLength);
+		void publishChanges();
+		SmartCachedValue* findValue(unsigned char sender, unsigned char type, unsigned char id, unsigned char insert);
+#if SW_RX_QUEUE_LENGTH
+		void queueData(unsigned char* inBytes, unsigned char numBytes, unsigned char generalCall);
+#endif
+		void processFrame(unsigned char* buffer, unsigned char bufferLength, unsigned char generalCall);
+		unsigned char* reserveEvent(unsigned char length);
+		void commitEvent();
+		unsigned char storeEvent(unsigned char* buffer, unsigned char bufferLength);
 	public:
-		static unsigned char frame[];
-		static unsigned char frameLength;
-		static unsigned int errorCount;
+		static TWI_NODE_LOCAL unsigned char frame[];
+		static TWI_NODE_LOCAL unsigned char frameLength;
+		// Counters, most of them written by the receive interrupt: read a
+		// consistent copy with getStats(), AVR reads them a byte at a time.
+		static TWI_NODE_LOCAL unsigned int errorCount;
+#if SW_RX_QUEUE_LENGTH
+		static TWI_NODE_LOCAL unsigned int droppedFrames; // deferred mode queue overflows
+#endif
+		static TWI_NODE_LOCAL unsigned long receiveMaxMicros; // longest time spent in the receive interrupt
+		static TWI_NODE_LOCAL unsigned int droppedEvents; // events lost because readingsBuffer was full
+		static TWI_NODE_LOCAL unsigned int filteredEvents; // events refused by setEventFilter()
+#if SW_ENABLE_RELIABLE
+		static TWI_NODE_LOCAL unsigned int duplicateEvents; // reliable events received again and dropped
+		static TWI_NODE_LOCAL unsigned int reliableRetransmits;
+		static TWI_NODE_LOCAL unsigned int reliableLost; // given up after SW_RELIABLE_RETRIES
+#endif
+		static TWI_NODE_LOCAL unsigned int pollsCompleted; // good reads by pollSlaves() and readCached()
+		static TWI_NODE_LOCAL unsigned int pollsFailed; // NACKed, exception or SW_POLL_TIMEOUT_MS
+		static TWI_NODE_LOCAL unsigned int cacheHits; // readCached() answered from the cache
+		static TWI_NODE_LOCAL unsigned int cacheMisses;
+		void getStats(SmartStats* stats); // snapshot of the counters above
 		void begin(unsigned char _slaveID, unsigned int _holdingRegsSize, unsigned int* _regs);
+		// Holding registers spread over banks (see SmartBank), sorted by
+		// start and not overlapping. A request must stay within one bank.
+		void begin(unsigned char _slaveID, const SmartBank* _banks, unsigned char _bankCount);
 		unsigned int calculateCRC(unsigned char* buffer, unsigned char bufferSize);
-		void sendPacket(unsigned char bufferSize);
-		void initEvent();
-		void writeToBuf(unsigned char b);
-		void writeToBuf(unsigned int b);
-		void writeToBuf(float b);
+		void sendPacket(unsigned char bufferSize); // frame[] by general call, blocking
+		unsigned char enqueuePacket(unsigned char bufferSize, void (*callback)(unsigned char));
+		// Events are built with beginEvent() and writeToBuf(), up to
+		// SW_EVENT_MAX_LENGTH bytes. writeToBuf() returns the number of
+		// bytes written, 0 when the value does not fit; it is then left out.
+		void beginEvent();
+		void initEvent(); // same as beginEvent()
+		unsigned char writeToBuf(unsigned char b);
+		unsigned char writeToBuf(unsigned int b);
+		unsigned char writeToBuf(float b);
+		unsigned char writeToBuf(const unsigned char* data, unsigned char length);
+		// Typed values, see SmartValues.h: the value type byte and the
+		// payload, all or nothing. A typed value is the whole event, there
+		// is no length to tell a second one apart: it must come right after
+		// beginEvent(), several values go in a batch (batchValue()).
+		// Returns the bytes written or 0.
+		template <class T> unsigned char writeValue(const T& value) {
+			static_assert(sizeof(T) <= SW_MAX_VALUE_PAYLOAD, "value type does not fit a frame");
+			if (eventPos != 3) // id, function, count
+				return 0;
+			unsigned char payload[sizeof(T)];
+			smartEncode(value, payload);
+			writeToBuf((unsigned char)T::type);
+			return 1 + writeToBuf(payload, sizeof(T));
+		}
+		// sends the event, as fragments when it is longer than BUFFER_LENGTH;
+		// a frame that loses arbitration is sent again after a backoff
 		void flush();
-		int available();
+		// Like flush() but returns at once, the frame is sent by the TWI
+		// interrupt. callback (may be 0) gets the endTransmission() status
+		// in interrupt context, once for all fragments (the first error).
+		// Returns 0 or 7 when the queue has no room for every fragment or
+		// the fragments of the previous event are still queued, see
+		// twi_getQueueStats() for queue depth and arbitration losses. A
+		// frame that loses arbitration is sent again after a random backoff
+		// (see twi_setBackoff()), the callback only sees the last attempt;
+		// poll() starts it if nothing else does.
+		unsigned char enqueue(void (*callback)(unsigned char));
+		// one value as a whole event, enqueue() status
+		template <class T> unsigned char enqueueValue(const T& value, void (*callback)(unsigned char)) {
+			beginEvent();
+			writeValue(value);
+			return enqueue(callback);
+		}
+#if SW_ENABLE_RELIABLE
+		// Reliable events (SW_ENABLE_RELIABLE): the event goes out as command 66 with a sequence
+		// number and stays in a window of SW_RELIABLE_WINDOW until every
+		// peer has acked it (see setReliablePeers()). Receivers store each
+		// event once and in order and ack what they expect next. poll()
+		// sends every unacked event again (go-back-N) when the oldest has
+		// waited a retransmission timeout, adapted to the measured round
+		// trip and doubled on each retry, and gives the oldest up after
+		// SW_RELIABLE_RETRIES. The event must fit one frame with 2 bytes
+		// to spare. Returns 0, 1 when it does not or 7 when the window or
+		// the TX queue is full.
+		unsigned char enqueueReliable();
+		template <class T> unsigned char enqueueReliableValue(const T& value) {
+			static_assert(sizeof(T) <= SW_MAX_VALUE_PAYLOAD, "value type does not fit a reliable event");
+			beginEvent();
+			writeValue(value);
+			return enqueueReliable();
+		}
+		// Nodes that must ack every reliable event, from the next one on.
+		// With none (the default) an ack from any node will do.
+		void setReliablePeers(const unsigned char* ids, unsigned char count);
+		unsigned char reliablePending(); // reliable events not acked yet
+#endif
+		// Batching: readings are packed into one value type 5 event that is
+		// queued when the next reading would not fit or when the oldest one
+		// has waited setBatchLinger() ms (0 sends every reading at once);
+		// call poll() from loop() for the latter. Returns 0, 1 when the
+		// reading can never fit a frame or 7 when the full batch found the
+		// TX queue full, the reading is then not taken.
+		unsigned char batchReading(unsigned char type, const unsigned char* data, unsigned char length);
+		unsigned char batchReading(unsigned char type, unsigned char value);
+		unsigned char batchReading(unsigned char type, unsigned int value);
+		unsigned char batchReading(unsigned char type, float value);
+		template <class T> unsigned char batchValue(const T& value) {
+			static_assert(sizeof(T) <= SW_MAX_VALUE_PAYLOAD, "value type does not fit a batch");
+			unsigned char payload[sizeof(T)];
+			smartEncode(value, payload);
+			return batchReading(T::type, payload, sizeof(T));
+		}
+		unsigned char sendBatch(); // queues the open batch now, 0 or 7
+		// Push on change: poll() compares the registers in watches (address,
+		// deadband and minInterval filled in) with the value last published
+		// and batches a value type 8 reading for each one that moved by more
+		// than its deadband, at most every minInterval ms. Values start as
+		// published; count 0 stops watching.
+		void watchRegisters(SmartWatch* _watches, unsigned char count);
+		// Master side: reads every line of table (slave, start, count,
+		// period, priority and values filled in) with function 3 every
+		// period ms, one request on the bus at a time. Of the lines that
+		// are due the one with the earliest deadline (due + period) goes
+		// first. The next request is queued as soon as a reply arrives, so
+		// it goes out right after it. A slave that fails is retried after
+		// period * 2^failures ms, at most SW_POLL_MAX_BACKOFF_MS. Timeouts
+		// and the first request need poll(); count 0 stops polling.
+		void pollSlaves(SmartPoll* table, unsigned char count);
+		// Master read cache: holding registers of slaves, one entry each,
+		// hashed by slave and address like setValueCache(). size 0 turns
+		// it off.
+		void setRegisterCache(SmartCachedRegister* entries, unsigned char size);
+#if SW_ENABLE_ADDRESSED_REPLIES
+		// Addressed replies (SW_ENABLE_ADDRESSED_REPLIES): a slave keeps the response to a request sent
+		// to its own address until the master reads it (slave transmit,
+		// through onRequest()) instead of sending it by general call to
+		// every node. A master reads the replies for pollSlaves() and
+		// readCached() with requestFrom() from poll(); a response that is
+		// not ready yet starts with 0 and is read again by the next
+		// poll(). Slaves and their master must use the same mode.
+		void setAddressedReplies(unsigned char enabled);
+#endif
+		// Copies count registers of slave from start into values and
+		// returns 1 when every one was read less than ttl ms ago. Else
+		// returns 0 (values incomplete) and the stale ones are read by
+		// poll(): registers missed since the last request that overlap or
+		// follow each other go out as one function 3 request of up to
+		// SW_MAX_READ_REGISTERS, ahead of pollSlaves() lines, so call
+		// again later. A failed read is tried again after ttl ms. Needs
+		// count free entries.
+		unsigned char readCached(unsigned char slave, unsigned int start, unsigned char count,
+			unsigned int* values, unsigned int ttl);
+		void setBatchLinger(unsigned int ms);
+		// Slotted publishing: millis() is cut into cycles of slots * slotMs
+		// (at most 65535) and queued frames only start within slot number
+		// slot of each, e.g. slot = ID - 1 and slots = number of nodes, so
+		// nodes publishing on the same tick take turns. It works as well as
+		// the nodes' clocks agree; frames that still collide are retried
+		// after a random backoff (see twi_setBackoff()). Needs poll(),
+		// slots 0 turns it off.
+		void setPublishSlot(unsigned char slot, unsigned char slots, unsigned int slotMs);
+		int available(); // number of unread events
+		// Zero copy access: peek() points straight into the event storage,
+		// the frame stays valid until release() hands the space back.
+		const unsigned char* peek(unsigned char* length); // oldest event, 0 if none
+		void release();
+		// Copying peek() + release(). An event reassembled from fragments
+		// is longer than SmartData holds: only its first BUFFER_LENGTH bytes
+		// are copied, the rest and the CRC are lost; use peek() for those.
 		SmartData readBuffer();
 		void onEventReceive( void (*)(void) );
+		// Subscription: events are only taken from senders with
+		// (id & senderMask) == senderMatch and of the value types whose
+		// bit is set in types (bit 31 stands for 31 and above). Anything
+		// else is NACKed as soon as its header arrives, before it is
+		// checked, copied, cached or stored. Fragments are filtered by
+		// sender only, batches by sender and bit 5.
+		void setEventFilter(unsigned char senderMask, unsigned char senderMatch, unsigned long types);
+		// limits values of SW_HAS_VALUE_ID() types to IDs added here,
+		// returns 0 when SW_FILTER_IDS are taken
+		unsigned char addEventFilterId(unsigned char id);
+		void clearEventFilter(); // take every event again
+		// Last value cache: every reading received is also kept in entries,
+		// newest per sender, value type and ID, even when the event storage
+		// is full. Hashed by key, so size should leave some entries free;
+		// when none is left a new key replaces one. size 0 turns it off.
+		void setValueCache(SmartCachedValue* entries, unsigned char size);
+		// Copies the newest reading and clears its changed flag, returns 0
+		// when none has been received. id as in SmartCachedValue.
+		unsigned char readValue(unsigned char sender, unsigned char type, unsigned char id, SmartCachedValue* out);
+		// Frames are checked byte by byte while they arrive (see
+		// onDataByte()). In deferred mode (SW_RX_QUEUE_LENGTH) the receive
+		// interrupt only queues the verified frame; poll() from loop() stores
+		// events and answers requests. poll() also sends batches whose linger time is over,
+		// publishes watched registers, runs pollSlaves() and readCached(),
+		// retransmits reliable events and starts frames held back by a
+		// backoff or setPublishSlot().
+#if SW_RX_QUEUE_LENGTH
+		void setDeferred(unsigned char enabled);
+#endif
+		void poll();
 };
 
 extern SmartTwoWire SmartWire;
@@ -0,0 +1,29 @@
+/*
+ BenchClock.h - tick source for the host benchmarks
+
+ Cycles from the time stamp counter on x86, nanoseconds elsewhere.
+ Absolute numbers say little about an ATmega; compare them between
+ revisions or back-ends on the same machine.
+*/
+
+#ifndef BenchClock_h
+#define BenchClock_h
+
+#include <inttypes.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t ticks() { return __rdtsc(); }
+static const char* tickUnit = "cycles";
+#else
+static inline uint64_t ticks()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+static const char* tickUnit = "ns";
+#endif
+
+#endif
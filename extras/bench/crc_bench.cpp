@@ -0,0 +1,117 @@
+/*
+ crc_bench.cpp - host-side comparison of the SmartCRC back-ends
+
+ Build and run on Linux from the repository root:
+   g++ -O2 -std=gnu++11 -I. extras/bench/crc_bench.cpp -o crc_bench && ./crc_bench
+
+ Ticks come from BenchClock.h; the ratios between the back-ends are what
+ matter.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include "SmartCRC.h"
+#include "BenchClock.h"
+
+#define FRAME_LENGTH 30 // BUFFER_LENGTH minus the two CRC bytes
+#define FRAMES 4096
+#define ROUNDS 50
+
+static uint8_t frames[FRAMES][FRAME_LENGTH];
+static volatile uint16_t sink;
+
+// SmartTwoWire::calculateCRC() before the SmartCRC engine was introduced
+static uint16_t legacyCRC(const uint8_t* buffer, uint8_t bufferSize)
+{
+	unsigned int temp, temp2, flag;
+	temp = 0xFFFF;
+	for (uint8_t i = 0; i < bufferSize; i++)
+	{
+		temp = temp ^ buffer[i];
+		for (uint8_t j = 1; j <= 8; j++)
+		{
+			flag = temp & 0x0001;
+			temp >>= 1;
+			if (flag)
+				temp ^= 0xA001;
+		}
+	}
+	temp2 = temp >> 8;
+	temp = (temp << 8) | temp2;
+	temp &= 0xFFFF;
+	return temp;
+}
+
+template <int engine>
+static uint16_t engineCRC(const uint8_t* buffer, uint8_t bufferSize)
+{
+	SmartCRC16<engine> crc;
+	crc.update(buffer, bufferSize);
+	return crc.value();
+}
+
+// byte at a time, the way the receive path feeds it
+template <int engine>
+static uint16_t incrementalCRC(const uint8_t* buffer, uint8_t bufferSize)
+{
+	SmartCRC16<engine> crc;
+	for (uint8_t i = 0; i < bufferSize; i++)
+		crc.update(buffer[i]);
+	return crc.value();
+}
+
+static double measure(uint16_t (*crc)(const uint8_t*, uint8_t))
+{
+	uint64_t best = ~0ULL;
+	for (int r = 0; r < ROUNDS; r++)
+	{
+		uint64_t start = ticks();
+		uint16_t acc = 0;
+		for (int f = 0; f < FRAMES; f++)
+			acc ^= crc(frames[f], FRAME_LENGTH);
+		uint64_t elapsed = ticks() - start;
+		sink = acc;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	return (double)best / (FRAMES * FRAME_LENGTH);
+}
+
+int main()
+{
+	srand(1);
+	for (int f = 0; f < FRAMES; f++)
+		for (int i = 0; i < FRAME_LENGTH; i++)
+			frames[f][i] = rand() & 0xFF;
+
+	struct {
+		const char* name;
+		uint16_t (*crc)(const uint8_t*, uint8_t);
+	} engines[] = {
+		{ "legacy", legacyCRC },
+		{ "bitwise", engineCRC<SW_CRC_BITWISE> },
+		{ "nibble", engineCRC<SW_CRC_NIBBLE> },
+		{ "table256", engineCRC<SW_CRC_TABLE256> },
+		{ "table256-incremental", incrementalCRC<SW_CRC_TABLE256> },
+	};
+	const int count = sizeof(engines) / sizeof(engines[0]);
+
+	for (int e = 1; e < count; e++)
+		for (int f = 0; f < FRAMES; f++)
+			if (engines[e].crc(frames[f], FRAME_LENGTH) != legacyCRC(frames[f], FRAME_LENGTH))
+			{
+				printf("%s disagrees with legacy CRC on frame %d\n", engines[e].name, f);
+				return 1;
+			}
+
+	double legacy = measure(legacyCRC);
+	printf("%-22s %10s %8s\n", "engine", tickUnit, "speedup");
+	for (int e = 0; e < count; e++)
+	{
+		double perByte = e ? measure(engines[e].crc) : legacy;
+		printf("%-22s %10.2f %7.1fx\n", engines[e].name, perByte, legacy / perByte);
+	}
+	return 0;
+}
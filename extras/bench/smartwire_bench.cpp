@@ -0,0 +1,614 @@
+/*
+ smartwire_bench.cpp - SmartWire protocol stack benchmark suite
+
+ Build and run on Linux from the repository root:
+   g++ -O2 -DTWI_HAL_HOST -DSW_ENABLE_RELIABLE=1 \
+     -Iextras/sim/host -Iextras/sim -Iextras/bench -I. \
+     -Ilibraries/WSWire -Ilibraries/WSWire/utility \
+     extras/bench/smartwire_bench.cpp extras/sim/VirtualBus.cpp extras/sim/EventLoad.cpp \
+     SmartWire.cpp libraries/WSWire/WSWire.cpp \
+     -x c libraries/WSWire/utility/twi.c -lpthread -o smartwire_bench
+   ./smartwire_bench [max nodes] > results.json
+
+ Prints one JSON document with a flat list of {"name", "value", "unit"}
+ results, so two runs can be compared name by name:
+
+  crc.*         CRC cost per byte for each SmartCRC back-end
+  receive.*     whole slave receive interrupt sequence (address, data
+                bytes, STOP) for a function 3 request, a function 16
+                request and an event, immediate, deferred and filtered
+                out by setEventFilter()
+  ring.*        taking events out of the event ring
+  latency.*     publish to release of broadcast events on a lightly
+                loaded virtual bus
+  throughput.*  overloaded bus: every node publishes every millisecond,
+                more than the bus can carry, for a growing number of nodes
+  batch.*       one node publishing a temperature every millisecond, as
+                single events and batched with a linger time
+  poll.*        one master reading 4 registers from each slave with
+                pollSlaves() as fast as it can, replies by general call
+                and addressed (setAddressedReplies())
+  reliable.*    small readings to two receivers, one of them reading its
+                events in bursts, as plain and as reliable events
+  cache.*       one master asking for two overlapping ranges of each
+                slave with readCached() every loop, with and without a ttl
+
+ crc, receive and ring are host ticks (see BenchClock.h), best of several
+ rounds. latency, throughput, batch, reliable, poll and cache come from simulated time and
+ are exactly reproducible.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+
+#include "VirtualBus.h"
+#include "EventLoad.h"
+#include "SmartWire.h"
+#include "BenchClock.h"
+
+#if !SW_ENABLE_RELIABLE || !SW_ENABLE_ADDRESSED_REPLIES || !SW_RX_QUEUE_LENGTH
+#error "the bench covers reliable events, build it with the flag above"
+#endif
+
+#define ROUNDS 20
+#define ITERATIONS 200
+#define EVENT_BATCH 8 // events per round trip through the ring, well below what it holds
+#define REGISTERS 16
+#define BENCH_ID 1
+
+typedef struct {
+	std::string name;
+	double value;
+	const char* unit;
+} Result;
+
+static std::vector<Result> results;
+static volatile unsigned int sink; // keeps measured results alive
+
+static void report(const std::string& name, double value, const char* unit)
+{
+	// inf and nan are not JSON
+	Result result = { name, std::isfinite(value) ? value : 0, unit };
+	results.push_back(result);
+}
+
+static std::string loadName(const char* group, const EventLoadConfig& config, const char* metric)
+{
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "%s.nodes%d.%lukhz.%s", group, config.nodes,
+		config.clockHz / 1000, metric);
+	return buffer;
+}
+
+static unsigned char sealFrame(unsigned char* frame, unsigned char length)
+{
+	SmartCRC crc;
+	crc.update(frame, length);
+	frame[length] = crc.value() >> 8;
+	frame[length + 1] = crc.value() & 0xFF;
+	return length + 2;
+}
+
+template <int engine>
+static double crcPerByte()
+{
+	static unsigned char data[BUFFER_LENGTH - 2];
+	uint64_t best = ~0ULL;
+
+	for (unsigned char i = 0; i < sizeof(data); i++)
+		data[i] = i * 37 + 11;
+	for (int r = 0; r < ROUNDS; r++) {
+		uint64_t start = ticks();
+		for (int n = 0; n < ITERATIONS * 10; n++) {
+			SmartCRC16<engine> crc;
+			crc.update(data, sizeof(data));
+			sink = crc.value();
+		}
+		uint64_t elapsed = ticks() - start;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	return (double)best / (ITERATIONS * 10 * sizeof(data));
+}
+
+// Runs the receive path micro benchmarks on a node's own thread, where
+// twi.c has its node state. Nothing on the bus, so replies stay queued.
+class ReceiveBenchNode : public SimNode
+{
+	public:
+		unsigned int regs[REGISTERS];
+
+		double receive(const unsigned char* frame, unsigned char length, bool generalCall)
+		{
+			uint64_t best = ~0ULL;
+			for (int r = 0; r < ROUNDS; r++) {
+				uint64_t start = ticks();
+				for (int n = 0; n < ITERATIONS; n++)
+					bus->injectFrame(frame, length, generalCall);
+				uint64_t elapsed = ticks() - start;
+				if (elapsed < best)
+					best = elapsed;
+			}
+			return (double)best / ITERATIONS;
+		}
+
+		void drain()
+		{
+			unsigned char length;
+			while (SmartWire.peek(&length))
+				SmartWire.release();
+		}
+
+		// event reception and the ring, batch by batch so it never fills
+		void eventRing(const unsigned char* frame, unsigned char length, bool deferred)
+		{
+			uint64_t bestStore = ~0ULL, bestPoll = ~0ULL, bestPeek = ~0ULL, bestCopy = ~0ULL;
+			unsigned int peeked = 0, copied = 0; // same every round
+
+			SmartWire.setDeferred(deferred);
+			for (int r = 0; r < ROUNDS; r++) {
+				uint64_t store = 0, poll = 0, peek = 0, copy = 0;
+				peeked = copied = 0;
+				for (int n = 0; n < ITERATIONS / EVENT_BATCH; n++) {
+					for (int e = 0; e < EVENT_BATCH; e += SW_RX_QUEUE_LENGTH) {
+						uint64_t start = ticks();
+						for (int q = 0; q < SW_RX_QUEUE_LENGTH; q++)
+							bus->injectFrame(frame, length, true);
+						uint64_t stored = ticks();
+						SmartWire.poll();
+						store += stored - start;
+						poll += ticks() - stored;
+					}
+
+					uint64_t start = ticks();
+					if (n & 1) {
+						for (int e = 0; e < EVENT_BATCH; e++)
+							sink = SmartWire.readBuffer().length;
+						copied += EVENT_BATCH;
+						copy += ticks() - start;
+					}
+					else {
+						const unsigned char* event;
+						unsigned char eventLength;
+						while ((event = SmartWire.peek(&eventLength)) != 0) {
+							sink = event[0];
+							SmartWire.release();
+							peeked++;
+						}
+						peek += ticks() - start;
+					}
+				}
+				bestStore = std::min(bestStore, store);
+				bestPoll = std::min(bestPoll, poll);
+				bestPeek = std::min(bestPeek, peek);
+				bestCopy = std::min(bestCopy, copy);
+			}
+			SmartWire.setDeferred(0);
+
+			const double events = ITERATIONS / EVENT_BATCH * EVENT_BATCH;
+			if (deferred) {
+				report("receive.event_deferred", bestStore / events, tickUnit);
+				report("receive.event_deferred.poll", bestPoll / events, tickUnit);
+			}
+			else {
+				report("receive.event", bestStore / events, tickUnit);
+				report("ring.peek_release", peeked ? (double)bestPeek / peeked : 0, tickUnit);
+				report("ring.read_buffer", copied ? (double)bestCopy / copied : 0, tickUnit);
+			}
+		}
+
+		void setup()
+		{
+			unsigned char frame[BUFFER_LENGTH];
+			unsigned char length;
+
+			SmartWire.begin(BENCH_ID, REGISTERS, regs);
+
+			// read 4 registers
+			frame[0] = BENCH_ID; frame[1] = 3;
+			frame[2] = 0; frame[3] = 2;
+			frame[4] = 0; frame[5] = 4;
+			length = sealFrame(frame, 6);
+			report("receive.function3", receive(frame, length, false), tickUnit);
+
+			// write 4 registers
+			frame[0] = BENCH_ID; frame[1] = 16;
+			frame[2] = 0; frame[3] = 2;
+			frame[4] = 0; frame[5] = 4;
+			frame[6] = 8;
+			for (unsigned char i = 0; i < 8; i++)
+				frame[7 + i] = i;
+			length = sealFrame(frame, 15);
+			report("receive.function16", receive(frame, length, false), tickUnit);
+
+			// temperature event from node 2, as beginEvent()/writeToBuf()/flush() build it
+			float temperature = 21.5;
+			unsigned char* bytes = (unsigned char*)&temperature;
+			frame[0] = 2; frame[1] = 0;
+			frame[3] = 2;
+			for (unsigned char i = 0; i < 4; i++)
+				frame[4 + i] = bytes[i];
+			frame[2] = 8 - 4;
+			length = sealFrame(frame, 8);
+			drain();
+			eventRing(frame, length, false);
+			eventRing(frame, length, true);
+			drain();
+
+			// the same event when the node did not subscribe to temperatures
+			SmartWire.setEventFilter(0, 0, ~(1UL << 2));
+			report("receive.event_filtered", receive(frame, length, true), tickUnit);
+			SmartWire.clearEventFilter();
+		}
+};
+
+#define BATCH_READINGS 500
+
+// node 0 publishes BATCH_READINGS temperatures 1 ms apart, node 1 counts
+// what arrives; lingerMs < 0 sends each one as a plain event
+class BatchNode : public SimNode
+{
+	public:
+		int lingerMs;
+		unsigned int regs[REGISTERS];
+		unsigned int published;
+		unsigned long received;
+		unsigned long nextPublish;
+
+		BatchNode(int _lingerMs) : lingerMs(_lingerMs), published(0), received(0), nextPublish(0) {}
+
+		void setup()
+		{
+			loopIntervalUs = 200;
+			SmartWire.begin(index + 1, REGISTERS, regs);
+			if (lingerMs >= 0)
+				SmartWire.setBatchLinger(lingerMs);
+		}
+
+		void loop()
+		{
+			const unsigned char* event;
+			unsigned char length;
+
+			SmartWire.poll();
+			while ((event = SmartWire.peek(&length)) != 0) {
+				SmartReadings readings(event, length);
+				const unsigned char* payload;
+				unsigned char type, size;
+				SmartTemperature reading;
+				while ((payload = readings.next(&type, &size)) != 0)
+					if (smartRead(type, payload, size, &reading))
+						received++;
+				SmartWire.release();
+			}
+
+			if (index != 0 || published == BATCH_READINGS || (long)(micros() - nextPublish) < 0)
+				return;
+			nextPublish += 1000;
+			SmartTemperature temperature = { 20 + published % 10 * 0.1f };
+			if (lingerMs < 0) {
+				if (SmartWire.enqueueValue(temperature, 0) == 0)
+					published++;
+			}
+			else if (SmartWire.batchValue(temperature) == 0)
+				published++;
+		}
+};
+
+static void batchLoad(int lingerMs)
+{
+	char name[32];
+	VirtualBus* bus = new VirtualBus(); // left allocated, see VirtualBus::add()
+	BatchNode* receiver = new BatchNode(lingerMs);
+
+	bus->add(new BatchNode(lingerMs));
+	bus->add(receiver);
+	bus->run(BATCH_READINGS * 1000 + 100000);
+
+	if (lingerMs < 0)
+		snprintf(name, sizeof(name), "batch.single");
+	else
+		snprintf(name, sizeof(name), "batch.linger%dms", lingerMs);
+	const VirtualBusStats& stats = bus->stats();
+	report(std::string(name) + ".readings", receiver->received, "readings");
+	report(std::string(name) + ".frames", stats.stops, "frames");
+	report(std::string(name) + ".bytes_per_reading",
+		receiver->received ? (double)stats.bytes / receiver->received : 0, "bytes");
+	report(std::string(name) + ".busy_per_reading",
+		receiver->received ? stats.busyNs / 1e3 / receiver->received : 0, "us");
+}
+
+#define RELIABLE_EVENTS 500
+
+// node 0 publishes RELIABLE_EVENTS temperatures 2 ms apart, nodes 1
+// and 2 count those that arrive; node 2 leaves its events unread for 100
+// ms out of every 200, so its event storage runs full
+class ReliableNode : public SimNode
+{
+	public:
+		int reliable;
+		unsigned int regs[REGISTERS];
+		unsigned int published;
+		unsigned long received;
+		unsigned long nextPublish;
+		unsigned int retransmits;
+
+		ReliableNode(int _reliable) : reliable(_reliable), published(0), received(0), nextPublish(0) {}
+
+		void setup()
+		{
+			loopIntervalUs = 500;
+			SmartWire.begin(index + 1, REGISTERS, regs);
+			if (index == 0 && reliable) {
+				static const unsigned char peers[] = { 2, 3 };
+				SmartWire.setReliablePeers(peers, 2);
+			}
+		}
+
+		void loop()
+		{
+			const unsigned char* event;
+			unsigned char length;
+
+			SmartWire.poll();
+			if (index == 2 && micros() % 200000 < 100000)
+				return;
+			SmartTemperatureFixed reading;
+			while ((event = SmartWire.peek(&length)) != 0) {
+				if (smartRead(event[3], event + 4, length - 6, &reading))
+					received++;
+				SmartWire.release();
+			}
+
+			if (index != 0)
+				return;
+			retransmits = SmartWire.reliableRetransmits;
+			if (published == RELIABLE_EVENTS || (long)(micros() - nextPublish) < 0)
+				return;
+			SmartTemperatureFixed temperature = { (int16_t)(2000 + published) };
+			if ((reliable ? SmartWire.enqueueReliableValue(temperature) : SmartWire.enqueueValue(temperature, 0)) == 0) {
+				published++;
+				nextPublish += 2000;
+			}
+		}
+};
+
+static void reliableLoad(int reliable)
+{
+	std::string name = reliable ? "reliable.on" : "reliable.off";
+	VirtualBus* bus = new VirtualBus(); // left allocated, see VirtualBus::add()
+	ReliableNode* sender = new ReliableNode(reliable);
+	ReliableNode* steady = new ReliableNode(reliable);
+	ReliableNode* bursty = new ReliableNode(reliable);
+
+	bus->add(sender);
+	bus->add(steady);
+	bus->add(bursty);
+	bus->run(RELIABLE_EVENTS * 2000 + 500000);
+
+	const VirtualBusStats& stats = bus->stats();
+	report(name + ".delivered", 100.0 * std::min(steady->received, bursty->received) / RELIABLE_EVENTS, "%");
+	report(name + ".retransmits", (double)sender->retransmits / RELIABLE_EVENTS, "frames/event");
+	report(name + ".frames", (double)stats.stops / RELIABLE_EVENTS, "frames/event");
+	report(name + ".bytes", (double)stats.bytes / RELIABLE_EVENTS, "bytes/event");
+}
+
+// every node publishes on the same tick, like meters reporting on the
+// same second: without backoff or slots, with backoff and with slots
+static void arbitrationLoad(int nodes, unsigned char backoff, unsigned int slotMs)
+{
+	std::string name = !backoff ? "arbitration.off" : slotMs ? "arbitration.slotted" : "arbitration.backoff";
+	EventLoadConfig config;
+	config.nodes = nodes;
+	config.clockHz = 100000;
+	config.periodUs = 100000;
+	config.deferred = 0;
+	config.seconds = 2;
+	config.aligned = 1;
+	config.backoff = backoff;
+	config.slotMs = slotMs;
+
+	EventLoadResult r = runEventLoad(config);
+	unsigned long expected = (r.sent + r.sendFailed) * (nodes - 1); // failed frames count as lost
+	report(name + ".delivered", expected ? 100.0 * r.received / expected : 0, "%");
+	report(name + ".arbitration_lost", r.published ? (double)r.arbitrationLost / r.published : 0, "per event");
+	report(name + ".retried", r.published ? (double)r.retried / r.published : 0, "per event");
+	report(name + ".p99", r.p99LatencyUs, "us");
+}
+
+#define POLL_REGISTERS 4
+
+// node 0 reads POLL_REGISTERS from every other node with pollSlaves() as
+// fast as the bus allows
+class PollNode : public SimNode
+{
+	public:
+		unsigned int regs[REGISTERS];
+		std::vector<SmartPoll> table;
+		std::vector<unsigned int> values;
+		int slaves;
+		int addressed;
+
+		PollNode(int _slaves, int _addressed) : slaves(_slaves), addressed(_addressed) {}
+
+		void setup()
+		{
+			loopIntervalUs = 200;
+			SmartWire.begin(index + 1, REGISTERS, regs);
+			SmartWire.setAddressedReplies(addressed);
+			if (index != 0)
+				return;
+			values.resize(slaves * POLL_REGISTERS);
+			for (int i = 0; i < slaves; i++) {
+				SmartPoll line = SmartPoll();
+				line.slave = i + 2;
+				line.count = POLL_REGISTERS;
+				line.values = &values[i * POLL_REGISTERS];
+				table.push_back(line);
+			}
+			SmartWire.pollSlaves(&table[0], slaves);
+		}
+
+		void loop()
+		{
+			SmartWire.poll();
+		}
+};
+
+static void pollLoad(int slaves, int addressed)
+{
+	char name[40];
+	VirtualBus* bus = new VirtualBus(); // left allocated, see VirtualBus::add()
+	PollNode* master = new PollNode(slaves, addressed);
+	const double seconds = 0.5;
+
+	bus->add(master);
+	for (int i = 0; i < slaves; i++)
+		bus->add(new PollNode(slaves, addressed));
+	bus->run((uint64_t)(seconds * 1e6));
+
+	snprintf(name, sizeof(name), "poll.slaves%d.100khz%s", slaves, addressed ? ".addressed" : "");
+	report(std::string(name) + ".reads", bus->stats().stops / 2 / seconds, "reads/s");
+	report(std::string(name) + ".busy", 100.0 * bus->stats().busyNs / (seconds * 1e9), "%");
+}
+
+// node 0 asks for registers 0-3 and 2-5 of every other node with
+// readCached() in every loop
+class CacheNode : public SimNode
+{
+	public:
+		unsigned int regs[REGISTERS];
+		SmartCachedRegister cache[64];
+		unsigned int values[4];
+		int slaves;
+		unsigned int ttl;
+		unsigned long hits, asked;
+
+		CacheNode(int _slaves, unsigned int _ttl) : slaves(_slaves), ttl(_ttl), hits(0), asked(0) {}
+
+		void setup()
+		{
+			loopIntervalUs = 200;
+			SmartWire.begin(index + 1, REGISTERS, regs);
+			if (index == 0)
+				SmartWire.setRegisterCache(cache, 64);
+		}
+
+		void loop()
+		{
+			if (index == 0) {
+				for (int i = 0; i < slaves; i++) {
+					hits += SmartWire.readCached(i + 2, 0, 4, values, ttl);
+					hits += SmartWire.readCached(i + 2, 2, 4, values, ttl);
+					asked += 2;
+				}
+			}
+			SmartWire.poll();
+		}
+};
+
+static void cacheLoad(int slaves, unsigned int ttl)
+{
+	char name[32];
+	VirtualBus* bus = new VirtualBus(); // left allocated, see VirtualBus::add()
+	CacheNode* master = new CacheNode(slaves, ttl);
+	const double seconds = 0.5;
+
+	bus->add(master);
+	for (int i = 0; i < slaves; i++)
+		bus->add(new CacheNode(slaves, ttl));
+	bus->run((uint64_t)(seconds * 1e6));
+
+	snprintf(name, sizeof(name), "cache.slaves%d.ttl%ums", slaves, ttl);
+	report(std::string(name) + ".requests", bus->stats().stops / 2 / seconds, "requests/s");
+	report(std::string(name) + ".hits", master->asked ? 100.0 * master->hits / master->asked : 0, "%");
+	report(std::string(name) + ".busy", 100.0 * bus->stats().busyNs / (seconds * 1e9), "%");
+}
+
+int main(int argc, char** argv)
+{
+	int maxNodes = argc > 1 ? atoi(argv[1]) : 50;
+	static const int nodeCounts[] = { 2, 5, 10, 20, 50, 100 };
+	static const unsigned long clocks[] = { 100000, 400000 };
+
+	report("crc.bitwise", crcPerByte<SW_CRC_BITWISE>(), "cycles/byte");
+	report("crc.nibble", crcPerByte<SW_CRC_NIBBLE>(), "cycles/byte");
+	report("crc.table256", crcPerByte<SW_CRC_TABLE256>(), "cycles/byte");
+	if (tickUnit[0] != 'c')
+		for (size_t i = 0; i < results.size(); i++)
+			results[i].unit = "ns/byte";
+
+	VirtualBus* bus = new VirtualBus(); // left allocated, see VirtualBus::add()
+	bus->add(new ReceiveBenchNode());
+	bus->run(1);
+
+	EventLoadConfig config;
+	config.clockHz = 100000;
+	config.deferred = 0;
+	config.periodUs = 50000;
+	config.seconds = 1;
+	config.aligned = 0;
+	config.backoff = 1;
+	config.slotMs = 0;
+	for (int nodes = 2; nodes <= 10 && nodes <= maxNodes; nodes += 8) {
+		config.nodes = nodes;
+		EventLoadResult r = runEventLoad(config);
+		report(loadName("latency", config, "avg"), r.averageLatencyUs, "us");
+		report(loadName("latency", config, "p99"), r.p99LatencyUs, "us");
+		report(loadName("latency", config, "max"), r.maxLatencyUs, "us");
+	}
+
+	config.periodUs = 1000;
+	config.seconds = 0.5;
+	for (size_t c = 0; c < sizeof(clocks) / sizeof(clocks[0]); c++) {
+		for (size_t n = 0; n < sizeof(nodeCounts) / sizeof(nodeCounts[0]); n++) {
+			if (nodeCounts[n] > maxNodes)
+				break;
+			config.nodes = nodeCounts[n];
+			config.clockHz = clocks[c];
+			EventLoadResult r = runEventLoad(config);
+			unsigned long missing = r.expected - std::min(r.expected, r.received);
+
+			report(loadName("throughput", config, "frames"), r.sent / config.seconds, "frames/s");
+			report(loadName("throughput", config, "events"), r.received / config.seconds, "events/s");
+			report(loadName("throughput", config, "drop"), r.expected ? 100.0 * missing / r.expected : 0, "%");
+			report(loadName("throughput", config, "send_failed"),
+				r.published ? 100.0 * r.sendFailed / r.published : 0, "%");
+			report(loadName("throughput", config, "busy"), 100.0 * r.bus.busyNs / (config.seconds * 1e9), "%");
+		}
+	}
+
+	batchLoad(-1);
+	batchLoad(0);
+	batchLoad(2);
+	batchLoad(20);
+
+	reliableLoad(0);
+	reliableLoad(1);
+
+	if (maxNodes >= 10) {
+		arbitrationLoad(10, 0, 0);
+		arbitrationLoad(10, 1, 0);
+		arbitrationLoad(10, 1, 2);
+	}
+
+	for (int slaves = 2; slaves <= 10 && slaves < maxNodes; slaves += 8)
+		pollLoad(slaves, 0);
+	for (int slaves = 2; slaves <= 10 && slaves < maxNodes; slaves += 8)
+		pollLoad(slaves, 1);
+	for (int slaves = 2; slaves <= 10 && slaves < maxNodes; slaves += 8) {
+		cacheLoad(slaves, 0);
+		cacheLoad(slaves, 50);
+	}
+
+	printf("{\n  \"suite\": \"smartwire\",\n  \"results\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+		printf("    {\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\"}%s\n", results[i].name.c_str(),
+			results[i].value, results[i].unit, i + 1 < results.size() ? "," : "");
+	printf("  ]\n}\n");
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ EventLoad.cpp - broadcast event load on a virtual bus
+*/
+
+#include <vector>
+#include <algorithm>
+
+#include "EventLoad.h"
+#include "SmartWire.h"
+
+#define REGISTERS 8
+
+class LoadNode : public SimNode
+{
+	public:
+		const EventLoadConfig* config;
+		std::vector<uint32_t>* latencies; // shared, only one node thread runs at a time
+		unsigned int regs[REGISTERS];
+		unsigned long nextPublish;
+		unsigned int seq;
+		unsigned long published, queueFull, sent, sendFailed, received;
+		unsigned long droppedEvents, droppedFrames, errors, timeouts;
+		unsigned long receiveMaxMicros;
+		twi_txQueueStats queue;
+
+		LoadNode(const EventLoadConfig* _config, std::vector<uint32_t>* _latencies) :
+			config(_config), latencies(_latencies), nextPublish(0), seq(0), published(0),
+			queueFull(0), sent(0), sendFailed(0), received(0), droppedEvents(0),
+			droppedFrames(0), errors(0), timeouts(0), receiveMaxMicros(0), queue() {}
+
+		// TX queue callback, interrupt context on this node's thread
+		static void onSent(unsigned char status)
+		{
+			LoadNode* node = static_cast<LoadNode*>(VirtualBus::self());
+			if (status == 0)
+				node->sent++;
+			else
+				node->sendFailed++;
+		}
+
+		void setup()
+		{
+			loopIntervalUs = 200;
+			SmartWire.begin(index + 1, REGISTERS, regs);
+			SmartWire.setClock(config->clockHz);
+#if SW_RX_QUEUE_LENGTH
+			SmartWire.setDeferred(config->deferred);
+#endif
+			twi_setBackoff(TWI_BACKOFF_SLOT_US, config->backoff ? TWI_BACKOFF_RETRIES : 0);
+			if (config->slotMs)
+				SmartWire.setPublishSlot(index, config->nodes, config->slotMs);
+			if (config->periodUs && !config->aligned)
+				nextPublish = micros() + random(config->periodUs);
+			else
+				nextPublish = micros();
+		}
+
+		void loop()
+		{
+			const unsigned char* event;
+			unsigned char length;
+
+			SmartWire.poll();
+
+			while ((event = SmartWire.peek(&length)) != 0) {
+				// [id][0][len][type][seq hi][seq lo][t3][t2][t1][t0][crc][crc]
+				if (length >= 10 && event[3] == 0) {
+					uint32_t stamp = ((uint32_t)event[6] << 24) | ((uint32_t)event[7] << 16) |
+						((uint32_t)event[8] << 8) | event[9];
+					latencies->push_back((uint32_t)micros() - stamp);
+					received++;
+				}
+				SmartWire.release();
+			}
+
+			if ((long)(micros() - nextPublish) >= 0) {
+				unsigned long now = micros();
+				nextPublish = config->periodUs ? nextPublish + config->periodUs : now;
+				SmartWire.beginEvent();
+				SmartWire.writeToBuf((unsigned char)0);
+				SmartWire.writeToBuf((unsigned int)seq);
+				SmartWire.writeToBuf((unsigned int)(now >> 16));
+				SmartWire.writeToBuf((unsigned int)(now & 0xFFFF));
+				if (SmartWire.enqueue(onSent) == 0) {
+					published++;
+					seq++;
+				}
+				else
+					queueFull++;
+			}
+
+			SmartStats stats;
+			SmartWire.getStats(&stats);
+			droppedEvents = stats.droppedEvents;
+#if SW_RX_QUEUE_LENGTH
+			droppedFrames = stats.droppedFrames;
+#endif
+			errors = stats.errorCount;
+			receiveMaxMicros = stats.receiveMaxMicros;
+			timeouts = twi_timeoutCount(TWI_PHASE_ACQUIRE) + twi_timeoutCount(TWI_PHASE_TRANSFER) +
+				twi_timeoutCount(TWI_PHASE_STOP);
+			twi_getQueueStats(&queue);
+		}
+};
+
+EventLoadResult runEventLoad(const EventLoadConfig& config)
+{
+	EventLoadResult result = EventLoadResult();
+	VirtualBus* bus = new VirtualBus();
+	std::vector<uint32_t> latencies;
+	std::vector<LoadNode*> nodes;
+
+	for (int i = 0; i < config.nodes; i++) {
+		nodes.push_back(new LoadNode(&config, &latencies));
+		bus->add(nodes.back());
+	}
+	bus->run((uint64_t)(config.seconds * 1e6));
+
+	for (int i = 0; i < config.nodes; i++) {
+		result.published += nodes[i]->published;
+		result.queueFull += nodes[i]->queueFull;
+		result.sent += nodes[i]->sent;
+		result.sendFailed += nodes[i]->sendFailed;
+		result.received += nodes[i]->received;
+		result.droppedEvents += nodes[i]->droppedEvents;
+		result.droppedFrames += nodes[i]->droppedFrames;
+		result.errors += nodes[i]->errors;
+		result.timeouts += nodes[i]->timeouts;
+		result.arbitrationLost += nodes[i]->queue.arbitrationLost;
+		result.retried += nodes[i]->queue.retried;
+		result.receiveMaxMicros = std::max(result.receiveMaxMicros, nodes[i]->receiveMaxMicros);
+	}
+	// every frame that made it onto the bus should reach all other nodes
+	result.expected = result.sent * (config.nodes - 1);
+
+	std::sort(latencies.begin(), latencies.end());
+	for (size_t i = 0; i < latencies.size(); i++)
+		result.averageLatencyUs += latencies[i];
+	if (!latencies.empty()) {
+		result.averageLatencyUs /= latencies.size();
+		result.p99LatencyUs = latencies[latencies.size() * 99 / 100];
+		result.maxLatencyUs = latencies.back();
+	}
+	result.bus = bus->stats();
+	return result;
+}
@@ -0,0 +1,48 @@
+/*
+ EventLoad.h - broadcast event load on a virtual bus
+
+ Every node publishes a type 0 event carrying a sequence number and its
+ micros() timestamp every periodUs (first one at a random offset, or at 0
+ on every node when aligned; 0 means whenever the TX queue has room) and
+ drains received events with peek()/release(). Latency is publish to
+ release, queueing in the sender's TX queue included.
+*/
+
+#ifndef EventLoad_h
+#define EventLoad_h
+
+#include <inttypes.h>
+
+#include "VirtualBus.h"
+
+typedef struct {
+	int nodes;
+	unsigned long clockHz;
+	unsigned long periodUs;
+	unsigned char deferred;
+	double seconds;
+	unsigned char aligned;
+	unsigned char backoff;   // retry after arbitration loss, see twi_setBackoff()
+	unsigned int slotMs;     // node i publishes in slot i, 0 for no slots
+} EventLoadConfig;
+
+typedef struct {
+	unsigned long published;  // accepted by enqueue()
+	unsigned long queueFull;  // enqueue() found the TX queue full
+	unsigned long sent;       // callback reported success
+	unsigned long sendFailed; // callback reported an error
+	unsigned long received;   // events read by the other nodes
+	unsigned long expected;   // sent * (nodes - 1)
+	unsigned long droppedEvents, droppedFrames, errors, timeouts;
+	unsigned long receiveMaxMicros;
+	unsigned long arbitrationLost, retried; // twi_getQueueStats() of all nodes
+	double averageLatencyUs;
+	uint32_t p99LatencyUs, maxLatencyUs;
+	VirtualBusStats bus;
+} EventLoadResult;
+
+// Runs on a fresh bus. Buses and nodes are left allocated, see
+// VirtualBus::add(), so a process can run several loads in a row.
+EventLoadResult runEventLoad(const EventLoadConfig& config);
+
+#endif
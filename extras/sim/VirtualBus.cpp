@@ -0,0 +1,666 @@
+/*
+ VirtualBus.cpp - host-side TWI bus simulator for SmartWire
+
+ Also provides the host side of Arduino.h and twi_hal.h for whichever
+ simulated node is running on the calling thread.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "Arduino.h"
+extern "C" {
+  #include "utility/twi_hal.h"
+}
+#include "VirtualBus.h"
+
+#define NODE_STACK_SIZE (256 * 1024)
+
+extern "C" {
+  __thread uint8_t sim_sreg = 0x80; // interrupts are enabled when setup() runs
+}
+
+static thread_local SimNode* currentNode = 0;
+static thread_local unsigned long randomState = 1;
+
+SimNode::SimNode() : loopIntervalUs(1000), index(0), twar(0), prescaler(0),
+	twbr(((F_CPU / 100000L) - 16) / 2), bus(0), wakeNs(0), interruptAtNs(0)
+{
+	reset();
+}
+
+void SimNode::reset()
+{
+	twen = twie = twea = false;
+	twint = false;
+	ack = false;
+	startRequested = false;
+	stopPending = false;
+	generalCall = false;
+	role = NONE;
+	request = CONTINUE;
+	status = TW_NO_INFO;
+	twdr = 0xFF;
+	inInterrupt = false;
+	interrupted = false;
+}
+
+// SCL period set by this node as master, see twi_setFrequency()
+uint64_t SimNode::bitNs() const
+{
+	return (16ULL + 2ULL * twbr * (1ULL << (2 * prescaler))) * 1000000000ULL / F_CPU;
+}
+
+VirtualBus::VirtualBus() : interruptLatencyUs(5), idleQuantumUs(50), now(0), seq(0),
+	state(IDLE), inFlight(false), addressPhase(false), readMode(false), lastEventNs(0)
+{
+	sem_init(&schedulerBaton, 0, 0);
+	memset(&busStats, 0, sizeof(busStats));
+}
+
+SimNode* VirtualBus::self()
+{
+	return currentNode;
+}
+
+// Node threads are parked when run() returns and are never joined; the
+// bus and its nodes have to live until the process exits.
+void VirtualBus::add(SimNode* node)
+{
+	pthread_attr_t attr;
+
+	node->bus = this;
+	node->index = nodes.size();
+	nodes.push_back(node);
+	sem_init(&node->baton, 0, 0);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, NODE_STACK_SIZE);
+	if (pthread_create(&node->thread, &attr, nodeMain, node)) {
+		perror("pthread_create");
+		abort();
+	}
+	pthread_attr_destroy(&attr);
+
+	schedule(WAKE, now, node);
+}
+
+void* VirtualBus::nodeMain(void* arg)
+{
+	SimNode* node = (SimNode*)arg;
+
+	currentNode = node;
+	randomState = node->index + 1;
+	sem_wait(&node->baton);
+
+	node->setup();
+	for (;;) {
+		node->loop();
+		node->bus->yieldUntil(node->bus->now + node->loopIntervalUs * 1000ULL, false);
+	}
+	return 0;
+}
+
+void VirtualBus::run(uint64_t durationUs)
+{
+	uint64_t end = now + durationUs * 1000ULL;
+
+	while (!events.empty() && events.top().time <= end) {
+		Event event = events.top();
+		events.pop();
+		now = event.time;
+
+		switch (event.kind) {
+			case WAKE:         resume(event.node); break;
+			case BUS_START:    busStart(); break;
+			case BUS_WRITE:    busWrite(); break;
+			case BUS_READ:     busRead(); break;
+			case BUS_STOP:     busStop(); break;
+			case BUS_REPSTART: busRepeatedStart(); break;
+		}
+	}
+	now = end;
+}
+
+void VirtualBus::schedule(EventKind kind, uint64_t time, SimNode* node)
+{
+	Event event = { time, seq++, kind, node };
+	events.push(event);
+}
+
+// hands the CPU to a node until it yields again
+void VirtualBus::resume(SimNode* node)
+{
+	sem_post(&node->baton);
+	sem_wait(&schedulerBaton);
+}
+
+// Runs on the node's thread. Sleeps until untilNs; with anyWake set it
+// returns after the first wake up instead, which is how twi busy-waits
+// notice interrupts and stop conditions without spinning.
+void VirtualBus::yieldUntil(uint64_t untilNs, bool anyWake)
+{
+	SimNode* node = currentNode;
+
+	for (;;) {
+		serviceInterrupt(node);
+		if (now >= untilNs)
+			return;
+		if (node->wakeNs != untilNs) {
+			node->wakeNs = untilNs;
+			schedule(WAKE, untilNs, node);
+		}
+
+		sem_post(&schedulerBaton);
+		sem_wait(&node->baton);
+
+		if (anyWake) {
+			serviceInterrupt(node);
+			return;
+		}
+	}
+}
+
+void VirtualBus::serviceInterrupt(SimNode* node)
+{
+	if (!node->twint || !node->twie || !node->twen || node->inInterrupt)
+		return;
+	if (!(sim_sreg & 0x80) || now < node->interruptAtNs)
+		return;
+
+	node->inInterrupt = true;
+	sim_sreg &= ~0x80;
+	twi_hal_isr();
+	sim_sreg |= 0x80;
+	node->inInterrupt = false;
+	node->interrupted = true;
+}
+
+// sets TWINT with a new status; the node is woken for its interrupt
+void VirtualBus::raise(SimNode* node, uint8_t status)
+{
+	node->status = status;
+	node->twint = true;
+	node->interruptAtNs = now + interruptLatencyUs * 1000ULL;
+	schedule(WAKE, node->interruptAtNs, node);
+}
+
+// TWCR write from the node's thread
+void VirtualBus::control(SimNode* node, uint8_t twcr)
+{
+	node->twie = twcr & _BV(TWIE);
+	node->twea = twcr & _BV(TWEA);
+
+	if (!(twcr & _BV(TWEN))) {
+		if (node->role != SimNode::NONE)
+			leave(node);
+		node->twen = false;
+		node->twint = false;
+		node->startRequested = false;
+		node->stopPending = false;
+		evaluate();
+		return;
+	}
+	node->twen = true;
+	// TWSTA is a plain control bit, rewriting TWCR without it cancels a
+	// START still waiting for the bus (e.g. when addressed meanwhile)
+	if (!(twcr & _BV(TWSTA)))
+		node->startRequested = false;
+
+	// writing TWINT one clears the flag and starts the next action
+	if (!(twcr & _BV(TWINT)))
+		return;
+	node->twint = false;
+	node->ack = node->twea;
+
+	if (twcr & _BV(TWSTO)) {
+		if (node->role == SimNode::MASTER) {
+			node->request = SimNode::STOP;
+			node->stopPending = true;
+		}
+		else if (node->role != SimNode::NONE)
+			leave(node); // slave: back to not addressed, TWSTO clears at once
+	}
+	else if (twcr & _BV(TWSTA)) {
+		if (node->role == SimNode::MASTER)
+			node->request = SimNode::START;
+		else
+			requestStart(node);
+	}
+	else
+		node->request = SimNode::CONTINUE;
+
+	evaluate();
+}
+
+uint8_t VirtualBus::controlState(SimNode* node)
+{
+	return (node->twint ? _BV(TWINT) : 0) | (node->twea ? _BV(TWEA) : 0) |
+		(node->stopPending ? _BV(TWSTO) : 0) | (node->twen ? _BV(TWEN) : 0) |
+		(node->twie ? _BV(TWIE) : 0);
+}
+
+void VirtualBus::injectFrame(const uint8_t* data, uint8_t length, bool generalCall)
+{
+	SimNode* node = currentNode;
+	uint8_t sreg = sim_sreg;
+	bool nacked = false;
+
+	sim_sreg &= ~0x80;
+	node->inInterrupt = true;
+
+	node->status = generalCall ? TW_SR_GCALL_ACK : TW_SR_SLA_ACK;
+	twi_hal_isr();
+	for (uint8_t i = 0; i < length; i++) {
+		node->twdr = data[i];
+		if (!node->ack) {
+			// NACKed, as on the bus the slave gets this byte and nothing more
+			node->status = generalCall ? TW_SR_GCALL_DATA_NACK : TW_SR_DATA_NACK;
+			twi_hal_isr();
+			nacked = true;
+			break;
+		}
+		node->status = generalCall ? TW_SR_GCALL_DATA_ACK : TW_SR_DATA_ACK;
+		twi_hal_isr();
+	}
+	// the NACK the slave prepares after the last byte is never sent, the
+	// master stops first as busStop() does
+	if (!nacked) {
+		node->status = TW_SR_STOP;
+		twi_hal_isr();
+	}
+
+	node->inInterrupt = false;
+	sim_sreg = sreg;
+}
+
+// a START is sent as soon as the bus is free; everyone asking before it
+// goes out starts together and arbitration sorts them out
+void VirtualBus::requestStart(SimNode* node)
+{
+	node->startRequested = true;
+	if (state == IDLE) {
+		state = START_SCHEDULED;
+		busStats.busyNs += node->bitNs();
+		schedule(BUS_START, now + node->bitNs(), 0);
+	}
+}
+
+void VirtualBus::leave(SimNode* node)
+{
+	masters.erase(std::remove(masters.begin(), masters.end(), node), masters.end());
+	slaves.erase(std::remove(slaves.begin(), slaves.end(), node), slaves.end());
+	node->role = SimNode::NONE;
+}
+
+uint64_t VirtualBus::transactionBitNs() const
+{
+	uint64_t bit = 0;
+	for (size_t i = 0; i < masters.size(); i++)
+		bit = std::max(bit, masters[i]->bitNs());
+	return bit ? bit : 10000;
+}
+
+// clocks the next bus step once nobody stretches SCL any more
+void VirtualBus::evaluate()
+{
+	if (state != ACTIVE || inFlight)
+		return;
+	if (masters.empty()) { // master went away mid transaction
+		busStop();
+		return;
+	}
+	for (size_t i = 0; i < masters.size(); i++)
+		if (masters[i]->twint)
+			return;
+	for (size_t i = 0; i < slaves.size(); i++)
+		if (slaves[i]->twint)
+			return;
+
+	busStats.stretchNs += now - lastEventNs;
+
+	uint64_t bit = transactionBitNs();
+	uint64_t duration;
+	EventKind kind;
+	if (masters[0]->request == SimNode::STOP) {
+		kind = BUS_STOP;
+		duration = bit;
+	}
+	else if (masters[0]->request == SimNode::START) {
+		kind = BUS_REPSTART;
+		duration = bit;
+	}
+	else {
+		kind = (addressPhase || !readMode) ? BUS_WRITE : BUS_READ;
+		duration = 9 * bit;
+	}
+	inFlight = true;
+	busStats.busyNs += duration;
+	schedule(kind, now + duration, 0);
+}
+
+void VirtualBus::busStart()
+{
+	masters.clear();
+	slaves.clear();
+	for (size_t i = 0; i < nodes.size(); i++) {
+		SimNode* node = nodes[i];
+		if (node->startRequested && node->twen) {
+			node->startRequested = false;
+			node->role = SimNode::MASTER;
+			node->request = SimNode::CONTINUE;
+			masters.push_back(node);
+			raise(node, TW_START);
+		}
+	}
+	if (masters.empty()) {
+		state = IDLE;
+		return;
+	}
+
+	busStats.starts++;
+	state = ACTIVE;
+	addressPhase = true;
+	readMode = false;
+	lastEventNs = now;
+}
+
+// master transmits a byte: address or data
+void VirtualBus::busWrite()
+{
+	std::vector<SimNode*> lost;
+	std::vector<SimNode*> winners;
+	uint8_t byte = 0xFF;
+
+	inFlight = false;
+	busStats.bytes++;
+
+	// open drain: the lowest byte wins, bit by bit from the MSB
+	for (size_t i = 0; i < masters.size(); i++)
+		byte = std::min(byte, masters[i]->twdr);
+	for (size_t i = 0; i < masters.size(); i++) {
+		if (masters[i]->twdr == byte)
+			winners.push_back(masters[i]);
+		else {
+			masters[i]->role = SimNode::NONE;
+			lost.push_back(masters[i]);
+			busStats.arbitrationLost++;
+		}
+	}
+	masters = winners;
+
+	if (addressPhase) {
+		uint8_t address = byte >> 1;
+		bool read = byte & TW_READ;
+
+		for (size_t i = 0; i < nodes.size(); i++) {
+			SimNode* node = nodes[i];
+			bool lostHere = std::find(lost.begin(), lost.end(), node) != lost.end();
+			if (node->role != SimNode::NONE || !node->twen || !node->twea)
+				continue;
+			if (node->twint && !lostHere) // still busy with its last interrupt
+				continue;
+
+			bool generalCall = address == 0 && !read && (node->twar & 1);
+			bool own = address != 0 && address == (node->twar >> 1);
+			if (!generalCall && !own)
+				continue;
+
+			node->role = read ? SimNode::SLAVE_TX : SimNode::SLAVE_RX;
+			node->generalCall = generalCall;
+			slaves.push_back(node);
+			if (read)
+				raise(node, lostHere ? TW_ST_ARB_LOST_SLA_ACK : TW_ST_SLA_ACK);
+			else if (generalCall)
+				raise(node, lostHere ? TW_SR_ARB_LOST_GCALL_ACK : TW_SR_GCALL_ACK);
+			else
+				raise(node, lostHere ? TW_SR_ARB_LOST_SLA_ACK : TW_SR_SLA_ACK);
+		}
+		for (size_t i = 0; i < lost.size(); i++)
+			if (lost[i]->role == SimNode::NONE)
+				raise(lost[i], TW_MT_ARB_LOST);
+
+		if (slaves.empty())
+			busStats.addressNacks++;
+		for (size_t i = 0; i < masters.size(); i++) {
+			if (read)
+				raise(masters[i], slaves.empty() ? TW_MR_SLA_NACK : TW_MR_SLA_ACK);
+			else
+				raise(masters[i], slaves.empty() ? TW_MT_SLA_NACK : TW_MT_SLA_ACK);
+		}
+		addressPhase = false;
+		readMode = read;
+	}
+	else {
+		bool acked = false;
+		std::vector<SimNode*> receivers = slaves;
+
+		for (size_t i = 0; i < lost.size(); i++)
+			raise(lost[i], TW_MT_ARB_LOST);
+		for (size_t i = 0; i < receivers.size(); i++) {
+			SimNode* slave = receivers[i];
+			slave->twdr = byte;
+			if (slave->ack) {
+				acked = true;
+				raise(slave, slave->generalCall ? TW_SR_GCALL_DATA_ACK : TW_SR_DATA_ACK);
+			}
+			else {
+				raise(slave, slave->generalCall ? TW_SR_GCALL_DATA_NACK : TW_SR_DATA_NACK);
+				leave(slave);
+			}
+		}
+		for (size_t i = 0; i < masters.size(); i++)
+			raise(masters[i], acked ? TW_MT_DATA_ACK : TW_MT_DATA_NACK);
+	}
+
+	lastEventNs = now;
+	evaluate();
+}
+
+// slave transmits a byte to the master
+void VirtualBus::busRead()
+{
+	SimNode* slave = slaves.empty() ? 0 : slaves[0];
+	uint8_t byte = slave ? slave->twdr : 0xFF;
+	bool masterAck = masters[0]->ack;
+
+	inFlight = false;
+	busStats.bytes++;
+
+	for (size_t i = 0; i < masters.size(); i++) {
+		masters[i]->twdr = byte;
+		raise(masters[i], masters[i]->ack ? TW_MR_DATA_ACK : TW_MR_DATA_NACK);
+	}
+	if (slave) {
+		if (!masterAck) {
+			raise(slave, TW_ST_DATA_NACK);
+			leave(slave);
+		}
+		else if (!slave->ack) { // slave said this was its last byte
+			raise(slave, TW_ST_LAST_DATA);
+			leave(slave);
+		}
+		else
+			raise(slave, TW_ST_DATA_ACK);
+	}
+
+	lastEventNs = now;
+	evaluate();
+}
+
+void VirtualBus::busStop()
+{
+	inFlight = false;
+	busStats.stops++;
+
+	for (size_t i = 0; i < masters.size(); i++) {
+		masters[i]->stopPending = false;
+		masters[i]->role = SimNode::NONE;
+		schedule(WAKE, now, masters[i]); // twi_stop() is waiting for TWSTO
+	}
+	for (size_t i = 0; i < slaves.size(); i++) {
+		if (slaves[i]->role == SimNode::SLAVE_RX)
+			raise(slaves[i], TW_SR_STOP);
+		slaves[i]->role = SimNode::NONE;
+	}
+	masters.clear();
+	slaves.clear();
+	state = IDLE;
+	lastEventNs = now;
+
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if (nodes[i]->startRequested) {
+			requestStart(nodes[i]);
+			break;
+		}
+	}
+}
+
+void VirtualBus::busRepeatedStart()
+{
+	inFlight = false;
+	busStats.starts++;
+
+	for (size_t i = 0; i < slaves.size(); i++) {
+		if (slaves[i]->role == SimNode::SLAVE_RX)
+			raise(slaves[i], TW_SR_STOP);
+		slaves[i]->role = SimNode::NONE;
+	}
+	slaves.clear();
+	for (size_t i = 0; i < masters.size(); i++) {
+		masters[i]->request = SimNode::CONTINUE;
+		raise(masters[i], TW_REP_START);
+	}
+	addressPhase = true;
+	readMode = false;
+	lastEventNs = now;
+}
+
+// Host side of Arduino.h ///////////////////////////////////////////////////////
+
+static VirtualBus* currentBus()
+{
+	return currentNode ? currentNode->bus : 0;
+}
+
+extern "C" {
+
+// 32 bit like on the AVR, so wrap around behaves the same
+unsigned long micros(void)
+{
+	VirtualBus* bus = currentBus();
+	return bus ? (uint32_t)(bus->nowNs() / 1000ULL) : 0;
+}
+
+unsigned long millis(void)
+{
+	VirtualBus* bus = currentBus();
+	return bus ? (uint32_t)(bus->nowNs() / 1000000ULL) : 0;
+}
+
+void delay(unsigned long ms)
+{
+	VirtualBus* bus = currentBus();
+	if (bus)
+		bus->yieldUntil(bus->nowNs() + ms * 1000000ULL, false);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+	VirtualBus* bus = currentBus();
+	if (bus)
+		bus->yieldUntil(bus->nowNs() + us * 1000ULL, false);
+}
+
+// SDA and SCL only matter to twi_busClear(); the virtual bus never hangs
+void pinMode(uint8_t pin, uint8_t mode)
+{
+	(void)pin;
+	(void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+	(void)pin;
+	(void)value;
+}
+
+int digitalRead(uint8_t pin)
+{
+	(void)pin;
+	return HIGH;
+}
+
+// Host side of twi_hal.h //////////////////////////////////////////////////////
+
+void twi_hal_control(uint8_t twcr)
+{
+	currentNode->bus->control(currentNode, twcr);
+}
+
+uint8_t twi_hal_controlState(void)
+{
+	return currentNode->bus->controlState(currentNode);
+}
+
+void twi_hal_writeData(uint8_t data)
+{
+	currentNode->twdr = data;
+}
+
+uint8_t twi_hal_readData(void)
+{
+	return currentNode->twdr;
+}
+
+uint8_t twi_hal_status(void)
+{
+	return currentNode->status;
+}
+
+void twi_hal_setAddress(uint8_t twar)
+{
+	currentNode->twar = twar;
+}
+
+uint8_t twi_hal_address(void)
+{
+	return currentNode->twar;
+}
+
+void twi_hal_setBitRate(uint8_t prescaler, uint8_t twbr)
+{
+	currentNode->prescaler = prescaler;
+	currentNode->twbr = twbr;
+}
+
+void twi_hal_idle(void)
+{
+	VirtualBus* bus = currentNode->bus;
+	bus->yieldUntil(bus->nowNs() + bus->idleQuantumUs * 1000ULL, true);
+}
+
+}
+
+// per node, reproducible from run to run
+long random(long howbig)
+{
+	if (howbig <= 0)
+		return 0;
+	randomState = randomState * 1103515245UL + 12345UL;
+	return (long)((randomState >> 8) % (unsigned long)howbig);
+}
+
+long random(long howsmall, long howbig)
+{
+	if (howsmall >= howbig)
+		return howsmall;
+	return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+	if (seed != 0)
+		randomState = seed;
+}
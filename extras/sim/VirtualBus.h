@@ -0,0 +1,160 @@
+/*
+ VirtualBus.h - host-side TWI bus simulator for SmartWire
+
+ Runs any number of unmodified WSWire/SmartWire nodes in one Linux process.
+ Each SimNode is a thread with its own copy of the library state
+ (TWI_NODE_LOCAL), but only one thread runs at a time and all of them
+ share one simulated clock, so a run is deterministic.
+
+ The bus models the ATmega TWI peripheral behind twi_hal.h at byte level:
+ START/repeated START/STOP, 9 bit times per byte at the master's SCL rate,
+ clock stretching while any participant has TWINT set, ACK/NACK, general
+ call, and bitwise arbitration between masters that start together
+ (losers that are addressed by the winner become slaves as on hardware).
+
+ Node code costs no simulated time except where it waits: loop() is called
+ every loopIntervalUs, delay()/delayMicroseconds() sleep, twi busy-waits
+ sleep until the next interrupt, and every TWI interrupt is taken
+ interruptLatencyUs after TWINT is raised.
+*/
+
+#ifndef VirtualBus_h
+#define VirtualBus_h
+
+#include <inttypes.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <queue>
+#include <vector>
+
+class VirtualBus;
+
+class SimNode
+{
+	friend class VirtualBus;
+	public:
+		SimNode();
+		virtual ~SimNode() {}
+		// both run on the node's own thread
+		virtual void setup() {}
+		virtual void loop() {}
+
+		unsigned long loopIntervalUs; // simulated time between loop() calls
+		unsigned char index; // position in the bus, set by VirtualBus::add()
+
+		// Everything below belongs to VirtualBus and the host twi_hal and
+		// Arduino functions in VirtualBus.cpp.
+		enum Role { NONE, MASTER, SLAVE_RX, SLAVE_TX };
+		enum Request { CONTINUE, START, STOP };
+
+		// TWI peripheral
+		bool twen, twie, twea;
+		bool twint;
+		bool ack; // TWEA when TWINT was last cleared
+		bool startRequested;
+		bool stopPending;
+		bool generalCall;
+		Role role;
+		Request request;
+		uint8_t status, twdr, twar, prescaler, twbr;
+
+		// CPU
+		VirtualBus* bus;
+		pthread_t thread;
+		sem_t baton;
+		bool inInterrupt;
+		bool interrupted; // an interrupt ran since the node last yielded
+		uint64_t wakeNs;
+		uint64_t interruptAtNs; // TWINT raised plus the interrupt latency
+
+		void reset();
+		uint64_t bitNs() const;
+};
+
+typedef struct {
+	unsigned long starts;           // START conditions, repeated ones included
+	unsigned long stops;            // completed transactions
+	unsigned long bytes;            // bytes clocked, address bytes included
+	unsigned long addressNacks;     // nobody answered the address
+	unsigned long arbitrationLost;  // masters that lost arbitration
+	uint64_t busyNs;                // time SCL was being clocked
+	uint64_t stretchNs;             // time the bus waited for a TWINT to clear
+} VirtualBusStats;
+
+class VirtualBus
+{
+	friend class SimNode;
+	public:
+		VirtualBus();
+
+		void add(SimNode* node);
+		// advances the simulation; can be called again to continue
+		void run(uint64_t durationUs);
+
+		uint64_t nowNs() const { return now; }
+		const VirtualBusStats& stats() const { return busStats; }
+
+		unsigned long interruptLatencyUs; // TWINT raised to ISR entry
+		unsigned long idleQuantumUs; // longest twi busy-wait between checks
+
+		// node whose thread is running, 0 on the scheduler thread
+		static SimNode* self();
+
+		// used by the host Arduino and twi_hal functions
+		void yieldUntil(uint64_t untilNs, bool anyWake);
+		void control(SimNode* node, uint8_t twcr);
+		uint8_t controlState(SimNode* node);
+
+		// Runs the slave receiver interrupts for one frame on the calling
+		// node as if it had been addressed, outside of bus timing. Bytes
+		// after a NACK are not delivered. Only for measuring the receive
+		// path; the node must not be on the bus.
+		void injectFrame(const uint8_t* data, uint8_t length, bool generalCall);
+
+	private:
+		enum State { IDLE, START_SCHEDULED, ACTIVE };
+		enum EventKind { WAKE, BUS_START, BUS_WRITE, BUS_READ, BUS_STOP, BUS_REPSTART };
+		struct Event {
+			uint64_t time;
+			uint64_t seq;
+			EventKind kind;
+			SimNode* node;
+			bool operator<(const Event& other) const
+			{
+				return time != other.time ? time > other.time : seq > other.seq;
+			}
+		};
+
+		std::vector<SimNode*> nodes;
+		std::priority_queue<Event> events;
+		uint64_t now;
+		uint64_t seq;
+		sem_t schedulerBaton;
+		VirtualBusStats busStats;
+
+		State state;
+		bool inFlight;
+		bool addressPhase;
+		bool readMode;
+		uint64_t lastEventNs; // end of the last bus step, for stretchNs
+		std::vector<SimNode*> masters;
+		std::vector<SimNode*> slaves;
+
+		static void* nodeMain(void* arg);
+		void schedule(EventKind kind, uint64_t time, SimNode* node);
+		void resume(SimNode* node);
+		void raise(SimNode* node, uint8_t status);
+		void serviceInterrupt(SimNode* node);
+		void requestStart(SimNode* node);
+		void leave(SimNode* node);
+		void evaluate();
+		uint64_t transactionBitNs() const;
+
+		void busStart();
+		void busWrite();
+		void busRead();
+		void busStop();
+		void busRepeatedStart();
+};
+
+#endif
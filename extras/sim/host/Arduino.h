@@ -0,0 +1,58 @@
+/*
+ Arduino.h - host stand-in used by the SmartWire simulator
+
+ Only what the WSWire and SmartWire sources use. Time, interrupts and pins
+ belong to the simulated node whose thread is running, see VirtualBus.cpp.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+#define SDA 18
+#define SCL 19
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// status register of the running node, only the I bit (0x80) is used
+extern __thread uint8_t sim_sreg;
+#define SREG sim_sreg
+#define cli() (sim_sreg &= (uint8_t)~0x80)
+#define sei() (sim_sreg |= 0x80)
+#define interrupts() sei()
+#define noInterrupts() cli()
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long);
+void delayMicroseconds(unsigned int);
+
+void pinMode(uint8_t, uint8_t);
+void digitalWrite(uint8_t, uint8_t);
+int digitalRead(uint8_t);
+
+#ifdef __cplusplus
+}
+
+long random(long);
+long random(long, long);
+void randomSeed(unsigned long);
+#endif
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ Print.h - host stand-in used by the SmartWire simulator
+*/
+
+#ifndef Print_h
+#define Print_h
+
+#include <inttypes.h>
+#include <stddef.h>
+
+class Print
+{
+  private:
+    int write_error;
+  protected:
+    void setWriteError(int err = 1) { write_error = err; }
+  public:
+    Print() : write_error(0) {}
+    virtual ~Print() {}
+    int getWriteError() { return write_error; }
+    void clearWriteError() { setWriteError(0); }
+
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+      size_t n = 0;
+      while (size--)
+        n += write(*buffer++);
+      return n;
+    }
+};
+
+#endif
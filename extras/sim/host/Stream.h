@@ -0,0 +1,20 @@
+/*
+ Stream.h - host stand-in used by the SmartWire simulator
+*/
+
+#ifndef Stream_h
+#define Stream_h
+
+#include "Arduino.h"
+#include "Print.h"
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+};
+
+#endif
@@ -0,0 +1,5 @@
+/*
+ Wire.h - the simulator builds SmartWire against WSWire
+*/
+
+#include "WSWire.h"
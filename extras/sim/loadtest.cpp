@@ -0,0 +1,62 @@
+/*
+ loadtest.cpp - N SmartWire nodes broadcasting events on a virtual bus
+
+ Build and run on Linux from the repository root:
+   g++ -O2 -DTWI_HAL_HOST -Iextras/sim/host -Iextras/sim -I. \
+     -Ilibraries/WSWire -Ilibraries/WSWire/utility \
+     extras/sim/loadtest.cpp extras/sim/EventLoad.cpp \
+     extras/sim/VirtualBus.cpp SmartWire.cpp libraries/WSWire/WSWire.cpp \
+     -x c libraries/WSWire/utility/twi.c -lpthread -o loadtest
+   ./loadtest [nodes] [clock Hz] [seconds] [publish period ms] [deferred]
+     [aligned] [backoff] [slot ms]
+
+ See EventLoad.h for what the nodes do; a period of 0 saturates the bus.
+ aligned 1 makes every node publish at the same time, backoff 0 turns
+ retries after arbitration loss off.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "EventLoad.h"
+
+int main(int argc, char** argv)
+{
+	EventLoadConfig config;
+	config.nodes = argc > 1 ? atoi(argv[1]) : 10;
+	config.clockHz = argc > 2 ? strtoul(argv[2], 0, 10) : 100000;
+	config.seconds = argc > 3 ? atof(argv[3]) : 2;
+	config.periodUs = argc > 4 ? strtoul(argv[4], 0, 10) * 1000 : 50000;
+	config.deferred = argc > 5 ? atoi(argv[5]) : 0;
+	config.aligned = argc > 6 ? atoi(argv[6]) : 0;
+	config.backoff = argc > 7 ? atoi(argv[7]) : 1;
+	config.slotMs = argc > 8 ? atoi(argv[8]) : 0;
+
+	if (config.nodes < 2 || config.nodes > 120) {
+		fprintf(stderr, "nodes must be between 2 and 120\n");
+		return 1;
+	}
+
+	EventLoadResult r = runEventLoad(config);
+	unsigned long missing = r.expected - std::min(r.expected, r.received);
+
+	printf("nodes %d, %lu Hz, %.1f s, publish every %lu ms%s%s%s", config.nodes, config.clockHz,
+		config.seconds, config.periodUs / 1000, config.deferred ? ", deferred" : "",
+		config.aligned ? ", aligned" : "", config.backoff ? "" : ", no backoff");
+	if (config.slotMs)
+		printf(", %u ms slots", config.slotMs);
+	printf("\n");
+	printf("frames      published %lu, sent %lu (%.1f/s), send failed %lu, queue full %lu\n",
+		r.published, r.sent, r.sent / config.seconds, r.sendFailed, r.queueFull);
+	printf("events      received %lu of %lu, dropped %.2f%% (buffer full %lu, rx queue %lu, errors %lu)\n",
+		r.received, r.expected, r.expected ? 100.0 * missing / r.expected : 0.0,
+		r.droppedEvents, r.droppedFrames, r.errors);
+	printf("latency us  avg %.0f, p99 %u, max %u; longest receive interrupt %lu us\n",
+		r.averageLatencyUs, r.p99LatencyUs, r.maxLatencyUs, r.receiveMaxMicros);
+	printf("bus         %lu starts, %lu bytes, %lu arbitration lost, %lu address nacks, %.1f%% busy, %.1f ms stretched, %lu twi timeouts\n",
+		r.bus.starts, r.bus.bytes, r.bus.arbitrationLost, r.bus.addressNacks,
+		100.0 * r.bus.busyNs / (config.seconds * 1e9), r.bus.stretchNs / 1e6, r.timeouts);
+	printf("tx queue    %lu arbitration lost, %lu retried\n", r.arbitrationLost, r.retried);
+	return 0;
+}
@@ -28,18 +28,18 @@ extern "C" {
 
 // Initialize Class Variables //////////////////////////////////////////////////
 
-uint8_t TwoWire::rxBuffer[BUFFER_LENGTH];
-uint8_t TwoWire::rxBufferIndex = 0;
-uint8_t TwoWire::rxBufferLength = 0;
+TWI_NODE_LOCAL uint8_t TwoWire::rxBuffer[BUFFER_LENGTH];
+TWI_NODE_LOCAL uint8_t TwoWire::rxBufferIndex = 0;
+TWI_NODE_LOCAL uint8_t TwoWire::rxBufferLength = 0;
 
-uint8_t TwoWire::txAddress = 0;
-uint8_t TwoWire::txBuffer[BUFFER_LENGTH];
-uint8_t TwoWire::txBufferIndex = 0;
-uint8_t TwoWire::txBufferLength = 0;
+TWI_NODE_LOCAL uint8_t TwoWire::txAddress = 0;
+TWI_NODE_LOCAL uint8_t TwoWire::txBuffer[BUFFER_LENGTH];
+TWI_NODE_LOCAL uint8_t TwoWire::txBufferIndex = 0;
+TWI_NODE_LOCAL uint8_t TwoWire::txBufferLength = 0;
 
-uint8_t TwoWire::transmitting = 0;
-void (*TwoWire::user_onRequest)(void);
-void (*TwoWire::user_onReceive)(int);
+TWI_NODE_LOCAL uint8_t TwoWire::transmitting = 0;
+TWI_NODE_LOCAL void (*TwoWire::user_onRequest)(void);
+TWI_NODE_LOCAL void (*TwoWire::user_onReceive)(int);
 
 // Constructors ////////////////////////////////////////////////////////////////
 
@@ -73,6 +73,13 @@ void TwoWire::begin(int address)
   begin((uint8_t)address);
 }
 
+// sets the SCL frequency for this node as master, e.g. 400000 for
+// Fast-mode; returns the frequency actually used, 0 if not achievable
+uint32_t TwoWire::setClock(uint32_t frequency)
+{
+  return twi_setFrequency(frequency);
+}
+
 uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity)
 {
   // clamp to buffer length
@@ -121,6 +128,20 @@ uint8_t TwoWire::endTransmission(void)
   return ret;
 }
 
+// like endTransmission() but only queues the buffer and returns at once;
+// callback receives the endTransmission() status from the twi interrupt
+uint8_t TwoWire::enqueueTransmission(void (*callback)(uint8_t))
+{
+  // queue buffer (non-blocking)
+  uint8_t ret = twi_enqueue(txAddress, txBuffer, txBufferLength, callback);
+  // reset tx buffer iterator vars
+  txBufferIndex = 0;
+  txBufferLength = 0;
+  // indicate that we are done transmitting
+  transmitting = 0;
+  return ret;
+}
+
 // must be called in:
 // slave tx event callback
 // or after beginTransmission(address)
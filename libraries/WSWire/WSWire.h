@@ -23,23 +23,27 @@
 #include <inttypes.h>
 #include "Stream.h"
 
+extern "C" {
+  #include "utility/twi.h"
+}
+
 #define BUFFER_LENGTH 32
 
 class TwoWire : public Stream
 {
   private:
-    static uint8_t rxBuffer[];
-    static uint8_t rxBufferIndex;
-    static uint8_t rxBufferLength;
+    static TWI_NODE_LOCAL uint8_t rxBuffer[];
+    static TWI_NODE_LOCAL uint8_t rxBufferIndex;
+    static TWI_NODE_LOCAL uint8_t rxBufferLength;
 
-    static uint8_t txAddress;
-    static uint8_t txBuffer[];
-    static uint8_t txBufferIndex;
-    static uint8_t txBufferLength;
+    static TWI_NODE_LOCAL uint8_t txAddress;
+    static TWI_NODE_LOCAL uint8_t txBuffer[];
+    static TWI_NODE_LOCAL uint8_t txBufferIndex;
+    static TWI_NODE_LOCAL uint8_t txBufferLength;
 
-    static uint8_t transmitting;
-    static void (*user_onRequest)(void);
-    static void (*user_onReceive)(int);
+    static TWI_NODE_LOCAL uint8_t transmitting;
+    static TWI_NODE_LOCAL void (*user_onRequest)(void);
+    static TWI_NODE_LOCAL void (*user_onReceive)(int);
     static void onRequestService(void);
     static void onReceiveService(uint8_t*, int);
   public:
@@ -47,9 +51,11 @@ class TwoWire : public Stream
     void begin();
     void begin(uint8_t);
     void begin(int);
+    uint32_t setClock(uint32_t);
     void beginTransmission(uint8_t);
     void beginTransmission(int);
     uint8_t endTransmission(void);
+    uint8_t enqueueTransmission(void (*)(uint8_t));
     uint8_t requestFrom(uint8_t, uint8_t);
     uint8_t requestFrom(int, int);
     virtual size_t write(uint8_t);
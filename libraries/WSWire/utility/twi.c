@@ -20,10 +20,8 @@
 #include <math.h>
 #include <stdlib.h>
 #include <inttypes.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <compat/twi.h>
 #include "Arduino.h" // for digitalWrite
+#include "twi_hal.h"
 
 #ifndef cbi
 #define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
@@ -33,29 +31,68 @@
 #define sbi(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
 #endif
 
-#include "pins_arduino.h"
 #include "twi.h"
 
-static volatile uint8_t trcase;//Nir
+static TWI_NODE_LOCAL volatile uint8_t trcase;//Nir
 
-static volatile uint8_t twi_state;
-static uint8_t twi_slarw;
+static TWI_NODE_LOCAL volatile uint8_t twi_state;
+static TWI_NODE_LOCAL uint8_t twi_slarw;
 
-static void (*twi_onSlaveTransmit)(void);
-static void (*twi_onSlaveReceive)(uint8_t*, int);
+static TWI_NODE_LOCAL void (*twi_onSlaveTransmit)(void);
+static TWI_NODE_LOCAL void (*twi_onSlaveReceive)(uint8_t*, int);
+static TWI_NODE_LOCAL uint8_t (*twi_onSlaveReceiveByte)(uint8_t, uint8_t, uint8_t);
 
-static uint8_t twi_masterBuffer[TWI_BUFFER_LENGTH];
-static volatile uint8_t twi_masterBufferIndex;
-static uint8_t twi_masterBufferLength;
+static TWI_NODE_LOCAL uint8_t twi_masterBuffer[TWI_BUFFER_LENGTH];
+static TWI_NODE_LOCAL volatile uint8_t twi_masterBufferIndex;
+static TWI_NODE_LOCAL uint8_t twi_masterBufferLength;
 
-static uint8_t twi_txBuffer[TWI_BUFFER_LENGTH];
-static volatile uint8_t twi_txBufferIndex;
-static volatile uint8_t twi_txBufferLength;
+static TWI_NODE_LOCAL uint8_t twi_txBuffer[TWI_BUFFER_LENGTH];
+static TWI_NODE_LOCAL volatile uint8_t twi_txBufferIndex;
+static TWI_NODE_LOCAL volatile uint8_t twi_txBufferLength;
 
-static uint8_t twi_rxBuffer[TWI_BUFFER_LENGTH];
-static volatile uint8_t twi_rxBufferIndex;
+static TWI_NODE_LOCAL uint8_t twi_rxBuffer[TWI_BUFFER_LENGTH];
+static TWI_NODE_LOCAL volatile uint8_t twi_rxBufferIndex;
 
-static volatile uint8_t twi_error;
+static TWI_NODE_LOCAL volatile uint8_t twi_error;
+
+static TWI_NODE_LOCAL uint8_t twi_prescaler = 0;
+static TWI_NODE_LOCAL uint8_t twi_bitRate = ((F_CPU / TWI_FREQ) - 16) / 2;
+
+static TWI_NODE_LOCAL twi_txFrame twi_txQueue[TWI_TXQ_LENGTH];
+static TWI_NODE_LOCAL volatile uint8_t twi_txQueueHead;
+static TWI_NODE_LOCAL volatile uint8_t twi_txQueueTail;
+static TWI_NODE_LOCAL volatile uint8_t twi_txQueueActive; // frame at the tail is on the bus
+static TWI_NODE_LOCAL volatile uint8_t twi_inInterrupt;
+static TWI_NODE_LOCAL twi_txQueueStats twi_queueStats;
+
+static TWI_NODE_LOCAL uint16_t twi_backoffSlot = TWI_BACKOFF_SLOT_US;
+static TWI_NODE_LOCAL uint8_t twi_backoffRetries = TWI_BACKOFF_RETRIES;
+static TWI_NODE_LOCAL uint16_t twi_backoffRandom = 0x9E37; // xorshift state, never 0
+static TWI_NODE_LOCAL volatile uint32_t twi_holdStart;
+static TWI_NODE_LOCAL volatile uint32_t twi_holdUs; // queue waits this long from twi_holdStart
+static TWI_NODE_LOCAL uint32_t twi_slotEpoch; // millis() a cycle started at
+static TWI_NODE_LOCAL uint16_t twi_slotLength;
+static TWI_NODE_LOCAL uint16_t twi_slotCycle; // 0 .. frames may start any time
+
+static uint8_t twi_write(uint8_t, uint8_t*, uint8_t, uint8_t);
+static uint8_t twi_writeStatus(void);
+static uint8_t twi_collided(uint8_t);
+static uint32_t twi_backoff(uint8_t);
+static uint8_t twi_acquire(uint8_t);
+static uint16_t twi_slotPhase(void);
+static void twi_startQueued(void);
+static void twi_serviceQueue(void);
+
+static TWI_NODE_LOCAL uint32_t twi_toutLimit[3] = {
+  TWI_TIMEOUT_ACQUIRE_US, TWI_TIMEOUT_TRANSFER_US, TWI_TIMEOUT_STOP_US
+};
+static TWI_NODE_LOCAL volatile uint32_t twi_toutStart[3];
+static TWI_NODE_LOCAL volatile uint16_t twi_toutCount[3];
+static TWI_NODE_LOCAL uint8_t twi_toutTail; // queue tail when the acquire timer started
+
+static void twi_toutBegin(uint8_t);
+static uint8_t twi_tout(uint8_t);
+static uint8_t twi_busHeld(void);
 
 /* 
  * Function twi_init
@@ -72,18 +109,54 @@ void twi_init(void)
   digitalWrite(SDA, 0);
   digitalWrite(SCL, 0);
 
-  // initialize twi prescaler and bit rate
-  cbi(TWSR, TWPS0);
-  cbi(TWSR, TWPS1);
-  TWBR = ((F_CPU / TWI_FREQ) - 16) / 2;
+  // initialize twi prescaler and bit rate, TWI_FREQ unless
+  // twi_setFrequency() chose something else
+  twi_hal_setBitRate(twi_prescaler, twi_bitRate);
 
   /* twi bit rate formula from atmega128 manual pg 204
-  SCL Frequency = CPU Clock Frequency / (16 + (2 * TWBR))
-  note: TWBR should be 10 or higher for master mode
+  SCL Frequency = CPU Clock Frequency / (16 + (2 * TWBR * 4^TWPS))
+  note: TWBR should be 10 or higher for master mode on older parts
   It is 72 for a 16mhz Wiring board with 100kHz TWI */
 
   // enable twi module, acks, and twi interrupt
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+  twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWEA));
+}
+
+/* 
+ * Function twi_setFrequency
+ * Desc     picks prescaler and TWBR for an SCL frequency at the current
+ *          F_CPU, never faster than requested; 400000 is Fast-mode and
+ *          1000000 Fast-mode Plus, if the part and the bus allow it
+ * Input    frequency: SCL frequency in Hz
+ * Output   frequency actually set in Hz
+ *          0 .. not achievable, bit rate unchanged
+ */
+uint32_t twi_setFrequency(uint32_t frequency)
+{
+  uint32_t divider;
+  uint8_t prescaler;
+
+  if(frequency == 0 || F_CPU / frequency < 16){
+    return 0;
+  }
+  // SCL = F_CPU / (16 + 2 * TWBR * 4^prescaler), round TWBR up
+  divider = (F_CPU + frequency - 1) / frequency - 16;
+  for(prescaler = 0; prescaler < 4; prescaler++){
+    uint32_t step = 2UL << (2 * prescaler);
+    uint32_t bitRate = (divider + step - 1) / step;
+    if(bitRate <= 255){
+#if TWI_MIN_TWBR > 0
+      if(bitRate < TWI_MIN_TWBR){
+        return 0;
+      }
+#endif
+      twi_prescaler = prescaler;
+      twi_bitRate = bitRate;
+      twi_hal_setBitRate(twi_prescaler, twi_bitRate);
+      return F_CPU / (16 + step * bitRate);
+    }
+  }
+  return 0; // too slow even with the largest prescaler
 }
 
 /* 
@@ -95,7 +168,20 @@ void twi_init(void)
 void twi_setAddress(uint8_t address)
 {
   // set twi slave address (skip over TWGCE bit)
-  TWAR = address << 1;
+  twi_hal_setAddress(address << 1);
+  // nodes draw different backoffs from the start
+  twi_backoffRandom = 0x9E37 ^ (address * 0x0101);
+}
+
+/* 
+ * Function twi_setGeneralCall
+ * Desc     enables or disables answering the general call address 0
+ * Input    enable: 1 to receive broadcasts
+ * Output   none
+ */
+void twi_setGeneralCall(uint8_t enable)
+{
+  twi_hal_setAddress((twi_hal_address() & 0xFE) | (enable ? 1 : 0));
 }
 
 /* 
@@ -117,12 +203,11 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length)
   }
 
   // wait until twi is ready, become master receiver
-  twi_tout(1);//Ini TimeOut
-  while(TWI_READY != twi_state){
-    if (twi_tout(0)) break;  
+  twi_toutBegin(TWI_PHASE_ACQUIRE);
+  while(!twi_acquire(TWI_MRX)){
+    if (twi_tout(TWI_PHASE_ACQUIRE)) return 0;
     continue;
   }
-  twi_state = TWI_MRX;
   // reset error state (0xFF.. no error occured)
   twi_error = 0xFF;
 
@@ -140,12 +225,12 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length)
   twi_slarw |= address << 1;
 
   // send start condition
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA);
+  twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA));
 
   // wait for read operation to complete
-  twi_tout(1);
+  twi_toutBegin(TWI_PHASE_TRANSFER);
   while(TWI_MRX == twi_state){
-    if (twi_tout(0)) break;  
+    if (twi_tout(TWI_PHASE_TRANSFER)) break;
     continue;
   }
 
@@ -163,7 +248,8 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length)
 /* 
  * Function twi_writeTo
  * Desc     attempts to become twi bus master and write a
- *          series of bytes to a device on the bus
+ *          series of bytes to a device on the bus; when waiting, a
+ *          write that lost arbitration is tried again, see twi_setBackoff()
  * Input    address: 7bit i2c device address
  *          data: pointer to byte array
  *          length: number of bytes in array
@@ -177,6 +263,42 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length)
  *          6 .. timed out while waiting for data to be sent
  */
 uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait)
+{
+  uint8_t attempts = 0;
+  uint8_t status, retry, sreg;
+  uint32_t start, delay;
+
+  for(;;){
+    status = twi_write(address, data, length, wait);
+    retry = wait && status >= 2 && status <= 4 && twi_collided(address) && attempts < twi_backoffRetries;
+    sreg = SREG;
+    cli();
+    if(4 == status && TW_MT_ARB_LOST == twi_error){
+      twi_queueStats.arbitrationLost++;
+    }
+    if(retry){
+      twi_queueStats.retried++;
+    }
+    SREG = sreg;
+    if(!retry){
+      return status;
+    }
+    attempts++;
+    delay = address ? 0 : twi_backoff(attempts);
+    start = micros();
+    while(micros() - start < delay){
+      twi_hal_idle();
+    }
+  }
+}
+
+/* 
+ * Function twi_write
+ * Desc     one attempt of twi_writeTo
+ * Input    as twi_writeTo
+ * Output   as twi_writeTo
+ */
+static uint8_t twi_write(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait)
 {
   uint8_t i;
 
@@ -186,12 +308,11 @@ uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait
   }
 
   // wait until twi is ready, become master transmitter
-  twi_tout(1);
-  while(TWI_READY != twi_state){
-    if (twi_tout(0)) return 5;
+  twi_toutBegin(TWI_PHASE_ACQUIRE);
+  while(!twi_acquire(TWI_MTX)){
+    if (twi_tout(TWI_PHASE_ACQUIRE)) return 5;
     continue;
   }
-  twi_state = TWI_MTX;
   // reset error state (0xFF.. no error occured)
   twi_error = 0xFF;
 
@@ -209,15 +330,29 @@ uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait
   twi_slarw |= address << 1;
   
   // send start condition
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA);
+  twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA));
 
   // wait for write operation to complete
-  twi_tout(1);  
+  twi_toutBegin(TWI_PHASE_TRANSFER);
   while(wait && (TWI_MTX == twi_state)){
-    if (twi_tout(0)) return 6;  
+    if (twi_tout(TWI_PHASE_TRANSFER)) return 6;
     continue;
   }
   
+  return twi_writeStatus();
+}
+
+/* 
+ * Function twi_writeStatus
+ * Desc     translates twi_error of the last master write
+ * Input    none
+ * Output   0 .. success
+ *          2 .. address send, NACK received
+ *          3 .. data send, NACK received
+ *          4 .. other twi error (lost bus arbitration, bus error, ..)
+ */
+static uint8_t twi_writeStatus(void)
+{
   if (twi_error == 0xFF)
     return 0;	// success
   else if (twi_error == TW_MT_SLA_NACK)
@@ -228,6 +363,318 @@ uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait
     return 4;	// other twi error
 }
 
+/* 
+ * Function twi_collided
+ * Desc     tells whether the last master write failed because another
+ *          master wrote at the same time: it lost arbitration, or it was
+ *          a general call nobody acknowledged, as happens when every
+ *          node on the bus starts one at once
+ * Input    address: 7bit i2c device address of the write
+ * Output   1 .. worth trying again
+ *          0 .. succeeded or failed for another reason
+ */
+static uint8_t twi_collided(uint8_t address)
+{
+  return TW_MT_ARB_LOST == twi_error || (0 == address && TW_MT_SLA_NACK == twi_error);
+}
+
+/* 
+ * Function twi_backoff
+ * Desc     picks how long to wait before the next attempt: a random
+ *          number of slots out of a window that doubles with every
+ *          attempt (truncated binary exponential backoff), plus an
+ *          eighth of a slot per the lowest three bits of the own address
+ *          so nodes that draw the same slot still start apart
+ * Input    attempts: collisions of the frame so far, 1 or more
+ * Output   microseconds
+ */
+static uint32_t twi_backoff(uint8_t attempts)
+{
+  uint16_t x = twi_backoffRandom;
+  uint8_t exp = attempts < TWI_BACKOFF_MAX_EXP ? attempts : TWI_BACKOFF_MAX_EXP;
+
+  x ^= x << 7;
+  x ^= x >> 9;
+  x ^= x << 8;
+  twi_backoffRandom = x;
+  return (uint32_t)twi_backoffSlot * (x & ((1 << exp) - 1)) +
+    (twi_backoffSlot >> 3) * ((twi_hal_address() >> 1) & 7);
+}
+
+/* 
+ * Function twi_acquire
+ * Desc     atomically claims an idle bus for a blocking master operation,
+ *          so a queued frame cannot be started from the interrupt between
+ *          the check and the claim
+ * Input    state: TWI_MRX or TWI_MTX
+ * Output   1 .. claimed
+ *          0 .. twi busy
+ */
+static uint8_t twi_acquire(uint8_t state)
+{
+  uint8_t sreg = SREG;
+  uint8_t claimed = 0;
+
+  cli();
+  if(TWI_READY == twi_state){
+    twi_state = state;
+    claimed = 1;
+  }
+  SREG = sreg;
+  return claimed;
+}
+
+/* 
+ * Function twi_enqueue
+ * Desc     queues a series of bytes to be written to a device on the bus
+ *          and returns immediately; the interrupt sends queued frames one
+ *          after another whenever the bus is free
+ * Input    address: 7bit i2c device address
+ *          data: pointer to byte array, copied before returning
+ *          length: number of bytes in array
+ *          callback: called from interrupt context with the twi_writeTo
+ *                    status of the frame once it is done, may be NULL
+ * Output   0 .. queued
+ *          1 .. length to long for buffer
+ *          7 .. queue full
+ */
+uint8_t twi_enqueue(uint8_t address, const uint8_t* data, uint8_t length, void (*callback)(uint8_t))
+{
+  uint8_t i;
+  uint8_t head;
+  uint8_t depth;
+  uint8_t sreg;
+  twi_txFrame* frame;
+
+  // ensure data will fit into buffer
+  if(TWI_BUFFER_LENGTH < length){
+    return 1;
+  }
+
+  // frames are queued from the main loop and from callbacks in the
+  // interrupt, so reserving, filling and publishing a slot is one step
+  sreg = SREG;
+  cli();
+  head = twi_txQueueHead;
+  depth = head - twi_txQueueTail;
+  if(depth >= TWI_TXQ_LENGTH){
+    twi_queueStats.dropped++;
+    SREG = sreg;
+    return 7;
+  }
+
+  frame = &twi_txQueue[head & (TWI_TXQ_LENGTH - 1)];
+  frame->address = address;
+  frame->length = length;
+  frame->callback = callback;
+  frame->attempts = 0;
+  for(i = 0; i < length; ++i){
+    frame->data[i] = data[i];
+  }
+  twi_txQueueHead = head + 1;
+  if(depth + 1 > twi_queueStats.maxDepth){
+    twi_queueStats.maxDepth = depth + 1;
+  }
+
+  // from interrupt context the frame is started when the current
+  // transaction has finished, see twi_serviceQueue
+  if(!twi_inInterrupt){
+    twi_startQueued();
+  }
+  SREG = sreg;
+  return 0;
+}
+
+/* 
+ * Function twi_getQueueStats
+ * Desc     reports transmit queue statistics
+ * Input    stats: filled with a snapshot of the counters
+ * Output   none
+ */
+void twi_getQueueStats(twi_txQueueStats* stats)
+{
+  uint8_t sreg = SREG;
+  cli();
+  *stats = twi_queueStats;
+  stats->depth = twi_txQueueHead - twi_txQueueTail;
+  SREG = sreg;
+}
+
+/* 
+ * Function twi_setBackoff
+ * Desc     sets how queued frames and waiting twi_writeTo() calls react
+ *          to a collision (see twi_collided): up to retries more attempts.
+ *          A general call waits a backoff of random slots first (see
+ *          twi_backoff): masters that lose one after its address byte
+ *          miss the winner's frame, and all that lost would start again
+ *          together right after the winner's stop. A write to one device
+ *          goes again as soon as the bus is free; losing it costs nothing
+ *          but the wait.
+ * Input    slotUs: backoff slot, about the length of a frame
+ *          retries: 0 fails the frame at once, as before
+ * Output   none
+ */
+void twi_setBackoff(uint16_t slotUs, uint8_t retries)
+{
+  uint8_t sreg = SREG;
+  cli();
+  twi_backoffSlot = slotUs;
+  twi_backoffRetries = retries;
+  SREG = sreg;
+}
+
+/* 
+ * Function twi_setTxSlot
+ * Desc     lets queued frames start only within a slot of a repeating
+ *          cycle of millis(), so nodes with periodic traffic and
+ *          different slots stay off each other's frames. Nodes agree on
+ *          the cycle only as far as their clocks do (started together or
+ *          set from a common time). twi_writeTo() is not held back.
+ * Input    offsetMs: start of the slot within the cycle
+ *          lengthMs: slot length, enough for the frames queued per cycle
+ *          cycleMs: cycle length, 0 to send any time (the default)
+ * Output   none
+ */
+void twi_setTxSlot(uint16_t offsetMs, uint16_t lengthMs, uint16_t cycleMs)
+{
+  uint8_t sreg = SREG;
+  uint32_t now;
+  cli();
+  twi_slotLength = lengthMs;
+  twi_slotCycle = cycleMs;
+  if(cycleMs){
+    now = millis();
+    twi_slotEpoch = now - (uint16_t)((now + cycleMs - offsetMs % cycleMs) % cycleMs);
+  }
+  SREG = sreg;
+}
+
+/* 
+ * Function twi_poll
+ * Desc     starts the oldest queued frame once its backoff is over or its
+ *          slot has come, if nothing else on the bus did; call it from
+ *          the main loop when using either
+ * Input    none
+ * Output   none
+ */
+void twi_poll(void)
+{
+  uint8_t sreg = SREG;
+  cli();
+  if(twi_slotCycle){
+    twi_slotPhase(); // keeps the epoch recent while nothing is queued
+  }
+  twi_startQueued();
+  SREG = sreg;
+}
+
+/* 
+ * Function twi_slotPhase
+ * Desc     milliseconds since the current cycle started. The phase is
+ *          counted from an epoch rather than from millis() itself, which
+ *          would jump when millis() wraps unless the cycle divides 2^32;
+ *          each call moves the epoch up by whole cycles, so it must come
+ *          at least every 49 days. Needs a cycle and interrupts disabled
+ * Input    none
+ * Output   phase within the cycle
+ */
+static uint16_t twi_slotPhase(void)
+{
+  uint32_t now = millis();
+  uint16_t phase = (now - twi_slotEpoch) % twi_slotCycle;
+
+  twi_slotEpoch = now - phase;
+  return phase;
+}
+
+/* 
+ * Function twi_startQueued
+ * Desc     becomes bus master for the oldest queued frame if twi is idle
+ *          and neither a backoff nor the slot holds it back, must be
+ *          called with interrupts disabled
+ * Input    none
+ * Output   none
+ */
+static void twi_startQueued(void)
+{
+  uint8_t i;
+  twi_txFrame* frame;
+
+  if(twi_txQueueActive || TWI_READY != twi_state || twi_txQueueTail == twi_txQueueHead){
+    return;
+  }
+  if(twi_holdUs){
+    if(micros() - twi_holdStart < twi_holdUs){
+      return;
+    }
+    twi_holdUs = 0;
+  }
+  if(twi_slotCycle && twi_slotPhase() >= twi_slotLength){
+    return;
+  }
+  frame = &twi_txQueue[twi_txQueueTail & (TWI_TXQ_LENGTH - 1)];
+
+  twi_state = TWI_MTX;
+  twi_txQueueActive = 1;
+  // reset error state (0xFF.. no error occured)
+  twi_error = 0xFF;
+
+  twi_masterBufferIndex = 0;
+  twi_masterBufferLength = frame->length;
+  for(i = 0; i < frame->length; ++i){
+    twi_masterBuffer[i] = frame->data[i];
+  }
+
+  // build sla+w, slave device address + w bit
+  twi_slarw = TW_WRITE;
+  twi_slarw |= frame->address << 1;
+
+  // send start condition
+  twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA));
+}
+
+/* 
+ * Function twi_serviceQueue
+ * Desc     completes the queued frame once its transaction is over and
+ *          starts the next one, called at the end of every twi interrupt
+ * Input    none
+ * Output   none
+ */
+static void twi_serviceQueue(void)
+{
+  if(twi_txQueueActive && TWI_MTX != twi_state){
+    twi_txFrame* frame = &twi_txQueue[twi_txQueueTail & (TWI_TXQ_LENGTH - 1)];
+    uint8_t status = twi_writeStatus();
+
+    if(TW_MT_ARB_LOST == twi_error){
+      twi_queueStats.arbitrationLost++;
+    }
+    if(twi_collided(frame->address) && frame->attempts < twi_backoffRetries){
+      // keep the frame at the tail and start it again, see twi_setBackoff
+      frame->attempts++;
+      twi_queueStats.retried++;
+      twi_txQueueActive = 0;
+      if(0 == frame->address){
+        twi_holdStart = micros();
+        twi_holdUs = twi_backoff(frame->attempts);
+      }
+      twi_startQueued();
+      return;
+    }
+    if(status){
+      twi_queueStats.failed++;
+    }else{
+      twi_queueStats.sent++;
+    }
+    twi_txQueueActive = 0;
+    twi_txQueueTail++;
+    if(frame->callback){
+      frame->callback(status);
+    }
+  }
+  twi_startQueued();
+}
+
 /* 
  * Function twi_transmit
  * Desc     fills slave tx buffer with data
@@ -272,6 +719,20 @@ void twi_attachSlaveRxEvent( void (*function)(uint8_t*, int) )
   twi_onSlaveReceive = function;
 }
 
+/* 
+ * Function twi_attachSlaveRxByte
+ * Desc     sets function called from the interrupt for every byte received
+ *          as slave, with the byte, its index in the frame and 1 when
+ *          addressed by general call. Returning 0 NACKs the next byte,
+ *          which makes the master give up on the frame.
+ * Input    function: callback function to use, 0 to acknowledge everything
+ * Output   none
+ */
+void twi_attachSlaveRxByte( uint8_t (*function)(uint8_t, uint8_t, uint8_t) )
+{
+  twi_onSlaveReceiveByte = function;
+}
+
 /* 
  * Function twi_attachSlaveTxEvent
  * Desc     sets function called before a slave write operation
@@ -293,9 +754,9 @@ void twi_reply(uint8_t ack)
 {
   // transmit master read ready signal, with or without ack
   if(ack){
-    TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
+    twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA));
   }else{
-	  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
+	  twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWINT));
   }
 }
 
@@ -308,13 +769,13 @@ void twi_reply(uint8_t ack)
 void twi_stop(void)
 {
   // send stop condition
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTO);
+  twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTO));
 
   // wait for stop condition to be exectued on bus
   // TWINT is not set after a stop condition!
-  twi_tout(1);  
-  while(TWCR & _BV(TWSTO)){
-    if (twi_tout(0)) return;  
+  twi_toutBegin(TWI_PHASE_STOP);
+  while(twi_hal_controlState() & _BV(TWSTO)){
+    if (twi_tout(TWI_PHASE_STOP)) return;
     continue;
   }
 
@@ -331,33 +792,179 @@ void twi_stop(void)
 void twi_releaseBus(void)
 {
   // release bus
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT);
+  twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT));
 
   // update twi state
   twi_state = TWI_READY;
 }
 
-//Nirea. Time Out
-static volatile uint32_t twi_toutc;
-uint8_t twi_tout(uint8_t ini)
+/* 
+ * Function twi_setTimeouts
+ * Desc     sets how long each phase of a bus operation may take before
+ *          it is abandoned and the bus is recovered
+ * Input    acquireUs: waiting for the bus to become free
+ *          transferUs: waiting for a master read or write to finish
+ *          stopUs: waiting for a stop condition to be executed
+ * Output   none
+ */
+void twi_setTimeouts(uint32_t acquireUs, uint32_t transferUs, uint32_t stopUs)
+{
+  twi_toutLimit[TWI_PHASE_ACQUIRE] = acquireUs;
+  twi_toutLimit[TWI_PHASE_TRANSFER] = transferUs;
+  twi_toutLimit[TWI_PHASE_STOP] = stopUs;
+}
+
+/* 
+ * Function twi_timeoutCount
+ * Desc     number of timeouts since start up in one phase
+ * Input    phase: TWI_PHASE_ACQUIRE, TWI_PHASE_TRANSFER or TWI_PHASE_STOP
+ * Output   count
+ */
+uint16_t twi_timeoutCount(uint8_t phase)
+{
+  uint16_t count;
+  uint8_t sreg = SREG;
+  cli();
+  count = twi_toutCount[phase];
+  SREG = sreg;
+  return count;
+}
+
+/* 
+ * Function twi_toutBegin
+ * Desc     starts the timer of a phase; every phase has its own start
+ *          time because twi_stop() runs in the interrupt while the main
+ *          loop may be waiting on a transfer
+ * Input    phase: TWI_PHASE_*
+ * Output   none
+ */
+static void twi_toutBegin(uint8_t phase)
+{
+  twi_toutStart[phase] = micros();
+  if(TWI_PHASE_ACQUIRE == phase){
+    twi_toutTail = twi_txQueueTail;
+  }
+}
+
+/* 
+ * Function twi_tout
+ * Desc     checks the timer of a phase and recovers the bus once it ran
+ *          out. micros() only advances by about a millisecond while
+ *          interrupts are disabled, which is plenty for the stop phase.
+ *          Waiting to acquire the bus behind our own TX queue starts over
+ *          whenever a queued frame finishes. Only our own twi module is
+ *          reset; the bus is cleared when it is still held after that, and
+ *          never when another master was talking to us as a slave.
+ * Input    phase: TWI_PHASE_*
+ * Output   1 .. timed out, bus recovered
+ *          0 .. still within the limit
+ */
+static uint8_t twi_tout(uint8_t phase)
+{
+  uint8_t addressed;
+
+  if(micros() - twi_toutStart[phase] < twi_toutLimit[phase]){
+    twi_hal_idle();
+    return 0;
+  }
+  if(TWI_PHASE_ACQUIRE == phase && twi_toutTail != twi_txQueueTail){
+    // our own queued frames had the bus and are moving, keep waiting
+    twi_toutBegin(phase);
+    twi_hal_idle();
+    return 0;
+  }
+  twi_toutCount[phase]++;
+
+  addressed = TWI_SRX == twi_state || TWI_STX == twi_state;
+  // abandon the transaction, ours or the one addressed to us, no need to
+  // touch bit rate; this releases whatever our module held
+  twi_hal_control(0);
+  twi_state = TWI_READY;
+  if(TWI_PHASE_ACQUIRE == phase && !addressed && twi_busHeld()){
+    // nobody released the bus, a slave may be holding SDA low
+    twi_busClear();
+  }else{
+    twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWEA));
+  }
+  if(twi_txQueueActive){
+    // the queued frame never finished, report it as failed
+    uint8_t sreg = SREG;
+    cli();
+    twi_error = TW_BUS_ERROR;
+    twi_serviceQueue();
+    SREG = sreg;
+  }
+  return 1;
+}
+
+/* 
+ * Function twi_busHeld
+ * Desc     with the twi module off, checks whether SDA or SCL stays low
+ *          for about 100us, longer than a bit of traffic between others
+ * Input    none
+ * Output   1 .. the bus is held low
+ *          0 .. both lines were seen high
+ */
+static uint8_t twi_busHeld(void)
 {
-	if (ini) twi_toutc=0; else twi_toutc++;	
-	if (twi_toutc>=100000UL) {
-		twi_toutc=0;
-		twi_init();
-		return 1;
-	}
-    return 0;  
+  uint8_t i;
+
+  pinMode(SDA, INPUT);
+  pinMode(SCL, INPUT);
+  for(i = 0; i < 10; i++){
+    if(digitalRead(SDA) && digitalRead(SCL)){
+      return 0;
+    }
+    delayMicroseconds(10);
+  }
+  return 1;
 }
 
-SIGNAL(TWI_vect)
+/* 
+ * Function twi_busClear
+ * Desc     releases a bus held by a slave that lost track of a transfer:
+ *          clocks SCL up to nine times until SDA is high, sends a stop
+ *          condition by hand and restarts the twi module
+ * Input    none
+ * Output   none
+ */
+void twi_busClear(void)
 {
-  switch(TW_STATUS){
+  uint8_t i;
+
+  // hand the pins back to the port, released (open drain)
+  twi_hal_control(0);
+  pinMode(SDA, INPUT);
+  pinMode(SCL, INPUT);
+  digitalWrite(SDA, 0);
+  digitalWrite(SCL, 0);
+
+  for(i = 0; i < 9 && !digitalRead(SDA); i++){
+    pinMode(SCL, OUTPUT);
+    delayMicroseconds(5);
+    pinMode(SCL, INPUT);
+    delayMicroseconds(5);
+  }
+
+  // stop: SDA rises while SCL is high
+  pinMode(SDA, OUTPUT);
+  delayMicroseconds(5);
+  pinMode(SDA, INPUT);
+  delayMicroseconds(5);
+
+  twi_state = TWI_READY;
+  twi_hal_control(_BV(TWEN) | _BV(TWIE) | _BV(TWEA));
+}
+
+TWI_HAL_ISR()
+{
+  twi_inInterrupt = 1;
+  switch(twi_hal_status()){
     // All Master
     case TW_START:     // sent start condition
     case TW_REP_START: // sent repeated start condition
       // copy device address and r/w bit to output register and ack
-      TWDR = twi_slarw;
+      twi_hal_writeData(twi_slarw);
       twi_reply(1);
       break;
 
@@ -367,7 +974,7 @@ SIGNAL(TWI_vect)
       // if there is data to send, send it, otherwise stop 
       if(twi_masterBufferIndex < twi_masterBufferLength){
         // copy data to output register and ack
-        TWDR = twi_masterBuffer[twi_masterBufferIndex++];
+        twi_hal_writeData(twi_masterBuffer[twi_masterBufferIndex++]);
         twi_reply(1);
       }else{
         twi_stop();
@@ -389,7 +996,7 @@ SIGNAL(TWI_vect)
     // Master Receiver
     case TW_MR_DATA_ACK: // data received, ack sent
       // put byte into buffer
-      twi_masterBuffer[twi_masterBufferIndex++] = TWDR;
+      twi_masterBuffer[twi_masterBufferIndex++] = twi_hal_readData();
     case TW_MR_SLA_ACK:  // address sent, ack received
       // ack if more bytes are expected, otherwise nack
       if(twi_masterBufferIndex < twi_masterBufferLength){
@@ -400,7 +1007,7 @@ SIGNAL(TWI_vect)
       break;
     case TW_MR_DATA_NACK: // data received, nack sent
       // put final byte into buffer
-      twi_masterBuffer[twi_masterBufferIndex++] = TWDR;
+      twi_masterBuffer[twi_masterBufferIndex++] = twi_hal_readData();
     case TW_MR_SLA_NACK: // address sent, nack received
       twi_stop();
       break;
@@ -411,6 +1018,9 @@ SIGNAL(TWI_vect)
     case TW_SR_GCALL_ACK: // addressed generally, returned ack
     case TW_SR_ARB_LOST_SLA_ACK:   // lost arbitration, returned ack
     case TW_SR_ARB_LOST_GCALL_ACK: // lost arbitration, returned ack
+      if(TWI_MTX == twi_state || TWI_MRX == twi_state){
+        twi_error = TW_MT_ARB_LOST;
+      }
       // enter slave receiver mode
       twi_state = TWI_SRX;
       // indicate that rx buffer can be overwritten and ack
@@ -421,9 +1031,14 @@ SIGNAL(TWI_vect)
     case TW_SR_GCALL_DATA_ACK: // data received generally, returned ack
       // if there is still room in the rx buffer
       if(twi_rxBufferIndex < TWI_BUFFER_LENGTH){
-        // put byte in buffer and ack
-        twi_rxBuffer[twi_rxBufferIndex++] = TWDR;
-        twi_reply(1);
+        uint8_t data = twi_hal_readData();
+        uint8_t ack = 1;
+        if(twi_onSlaveReceiveByte){
+          ack = twi_onSlaveReceiveByte(data, twi_rxBufferIndex, TW_SR_GCALL_DATA_ACK == twi_hal_status());
+        }
+        // put byte in buffer and ack unless the frame was refused
+        twi_rxBuffer[twi_rxBufferIndex++] = data;
+        twi_reply(ack);
       }else{
         // otherwise nack
         twi_reply(0);
@@ -445,13 +1060,18 @@ SIGNAL(TWI_vect)
       break;
     case TW_SR_DATA_NACK:       // data received, returned nack
     case TW_SR_GCALL_DATA_NACK: // data received generally, returned nack
-      // nack back at master
-      twi_reply(0);
+      // the frame was refused and we are no longer addressed, so no stop
+      // will be reported: drop it and ack our address again
+      twi_rxBufferIndex = 0;
+      twi_releaseBus();
       break;
     
     // Slave Transmitter
     case TW_ST_SLA_ACK:          // addressed, returned ack
     case TW_ST_ARB_LOST_SLA_ACK: // arbitration lost, returned ack
+      if(TWI_MTX == twi_state || TWI_MRX == twi_state){
+        twi_error = TW_MT_ARB_LOST;
+      }
       // enter slave transmitter mode
       twi_state = TWI_STX;
       // ready the tx buffer index for iteration
@@ -469,7 +1089,7 @@ SIGNAL(TWI_vect)
       // transmit first byte from buffer, fall
     case TW_ST_DATA_ACK: // byte sent, ack returned
       // copy data to output register
-      TWDR = twi_txBuffer[twi_txBufferIndex++];
+      twi_hal_writeData(twi_txBuffer[twi_txBufferIndex++]);
       // if there is more to send, ack, otherwise nack
       if(twi_txBufferIndex < twi_txBufferLength){
         twi_reply(1);
@@ -493,5 +1113,7 @@ SIGNAL(TWI_vect)
       twi_stop();
       break;
   }
+  twi_serviceQueue();
+  twi_inInterrupt = 0;
 }
 
@@ -22,33 +22,114 @@
 
   #include <inttypes.h>
 
+  // Storage that belongs to one node. Plain static data on a board; the
+  // host simulator (TWI_HAL_HOST) runs every simulated node on its own
+  // thread, so there it is thread local.
+  #if defined(TWI_HAL_HOST) && defined(__cplusplus)
+  #define TWI_NODE_LOCAL thread_local
+  #elif defined(TWI_HAL_HOST)
+  #define TWI_NODE_LOCAL __thread
+  #else
+  #define TWI_NODE_LOCAL
+  #endif
+
   //#define ATMEGA8
 
   #ifndef TWI_FREQ
   #define TWI_FREQ 100000L
   #endif
 
+  // lowest TWBR twi_setFrequency() accepts, older parts need 10
+  #ifndef TWI_MIN_TWBR
+  #define TWI_MIN_TWBR 0
+  #endif
+
   #ifndef TWI_BUFFER_LENGTH
   #define TWI_BUFFER_LENGTH 32
   #endif
 
+  // frames twi_enqueue() can hold, a power of two up to 128: the ring is
+  // indexed by masking 8 bit counters
+  #ifndef TWI_TXQ_LENGTH
+  #define TWI_TXQ_LENGTH 4
+  #endif
+  #if (TWI_TXQ_LENGTH & (TWI_TXQ_LENGTH - 1)) || TWI_TXQ_LENGTH < 1 || TWI_TXQ_LENGTH > 128
+  #error "TWI_TXQ_LENGTH must be a power of two no larger than 128"
+  #endif
+
+  // retries of a frame that lost arbitration, see twi_setBackoff()
+  #ifndef TWI_BACKOFF_RETRIES
+  #define TWI_BACKOFF_RETRIES 6
+  #endif
+  // backoff slot, about one short frame at 100 kHz
+  #ifndef TWI_BACKOFF_SLOT_US
+  #define TWI_BACKOFF_SLOT_US 1000
+  #endif
+  // the backoff window doubles up to 2^TWI_BACKOFF_MAX_EXP slots
+  #ifndef TWI_BACKOFF_MAX_EXP
+  #define TWI_BACKOFF_MAX_EXP 4
+  #endif
+
+  // bus operation time limits in microseconds, see twi_setTimeouts()
+  #ifndef TWI_TIMEOUT_ACQUIRE_US
+  #define TWI_TIMEOUT_ACQUIRE_US 5000
+  #endif
+  #ifndef TWI_TIMEOUT_TRANSFER_US
+  #define TWI_TIMEOUT_TRANSFER_US 5000
+  #endif
+  #ifndef TWI_TIMEOUT_STOP_US
+  #define TWI_TIMEOUT_STOP_US 200
+  #endif
+
+  #define TWI_PHASE_ACQUIRE  0
+  #define TWI_PHASE_TRANSFER 1
+  #define TWI_PHASE_STOP     2
+
   #define TWI_READY 0
   #define TWI_MRX   1
   #define TWI_MTX   2
   #define TWI_SRX   3
   #define TWI_STX   4
   
+  typedef struct {
+    uint8_t address;
+    uint8_t length;
+    uint8_t data[TWI_BUFFER_LENGTH];
+    void (*callback)(uint8_t);
+    uint8_t attempts; // lost arbitration this often so far
+  } twi_txFrame;
+
+  typedef struct {
+    uint8_t depth;     // frames waiting or on the bus
+    uint8_t maxDepth;  // highest depth seen
+    uint16_t sent;
+    uint16_t failed;   // completed with a non zero status
+    uint16_t dropped;  // rejected because the queue was full
+    uint16_t arbitrationLost; // by queued frames and twi_writeTo()
+    uint16_t retried;  // attempts repeated after a collision
+  } twi_txQueueStats;
+
   void twi_init(void);
   void twi_setAddress(uint8_t);
+  void twi_setGeneralCall(uint8_t);
+  uint32_t twi_setFrequency(uint32_t);
   uint8_t twi_readFrom(uint8_t, uint8_t*, uint8_t);
   uint8_t twi_writeTo(uint8_t, uint8_t*, uint8_t, uint8_t);
+  uint8_t twi_enqueue(uint8_t, const uint8_t*, uint8_t, void (*)(uint8_t));
+  void twi_getQueueStats(twi_txQueueStats*);
+  void twi_setBackoff(uint16_t, uint8_t);
+  void twi_setTxSlot(uint16_t, uint16_t, uint16_t);
+  void twi_poll(void);
   uint8_t twi_transmit(const uint8_t*, uint8_t);
   void twi_attachSlaveRxEvent( void (*)(uint8_t*, int) );
+  void twi_attachSlaveRxByte( uint8_t (*)(uint8_t, uint8_t, uint8_t) );
   void twi_attachSlaveTxEvent( void (*)(void) );
   void twi_reply(uint8_t);
   void twi_stop(void);
   void twi_releaseBus(void);
-  uint8_t twi_tout(uint8_t);
+  void twi_setTimeouts(uint32_t, uint32_t, uint32_t);
+  uint16_t twi_timeoutCount(uint8_t);
+  void twi_busClear(void);
 
 #endif
 
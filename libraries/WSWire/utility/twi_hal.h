@@ -0,0 +1,107 @@
+/*
+  twi_hal.h - TWI peripheral access for twi.c
+
+  twi.c only touches the TWI hardware through the functions below. On AVR
+  they are the TWCR/TWDR/TWSR/TWAR/TWBR registers; with TWI_HAL_HOST they
+  are implemented by a simulated ATmega TWI peripheral (see extras/sim),
+  which uses the same control bits and status codes.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+*/
+
+#ifndef twi_hal_h
+#define twi_hal_h
+
+#include <inttypes.h>
+
+#if !defined(TWI_HAL_HOST)
+
+  #include <avr/io.h>
+  #include <avr/interrupt.h>
+  #include <compat/twi.h>
+  #include "pins_arduino.h"
+
+  #define TWI_HAL_ISR() SIGNAL(TWI_vect)
+
+  static inline void twi_hal_control(uint8_t twcr) { TWCR = twcr; }
+  static inline uint8_t twi_hal_controlState(void) { return TWCR; }
+  static inline void twi_hal_writeData(uint8_t data) { TWDR = data; }
+  static inline uint8_t twi_hal_readData(void) { return TWDR; }
+  static inline uint8_t twi_hal_status(void) { return TW_STATUS; }
+  static inline void twi_hal_setAddress(uint8_t twar) { TWAR = twar; }
+  static inline uint8_t twi_hal_address(void) { return TWAR; }
+  static inline void twi_hal_setBitRate(uint8_t prescaler, uint8_t twbr)
+  {
+    TWSR = (TWSR & ~(_BV(TWPS0) | _BV(TWPS1))) | prescaler;
+    TWBR = twbr;
+  }
+  // called while twi busy-waits, nothing to do on real hardware
+  static inline void twi_hal_idle(void) {}
+
+#else
+
+  #ifndef _BV
+  #define _BV(bit) (1 << (bit))
+  #endif
+
+  // TWCR bits
+  #define TWINT 7
+  #define TWEA  6
+  #define TWSTA 5
+  #define TWSTO 4
+  #define TWWC  3
+  #define TWEN  2
+  #define TWIE  0
+
+  // TWSR status codes, as in <compat/twi.h>
+  #define TW_START                  0x08
+  #define TW_REP_START              0x10
+  #define TW_MT_SLA_ACK             0x18
+  #define TW_MT_SLA_NACK            0x20
+  #define TW_MT_DATA_ACK            0x28
+  #define TW_MT_DATA_NACK           0x30
+  #define TW_MT_ARB_LOST            0x38
+  #define TW_MR_ARB_LOST            0x38
+  #define TW_MR_SLA_ACK             0x40
+  #define TW_MR_SLA_NACK            0x48
+  #define TW_MR_DATA_ACK            0x50
+  #define TW_MR_DATA_NACK           0x58
+  #define TW_ST_SLA_ACK             0xA8
+  #define TW_ST_ARB_LOST_SLA_ACK    0xB0
+  #define TW_ST_DATA_ACK            0xB8
+  #define TW_ST_DATA_NACK           0xC0
+  #define TW_ST_LAST_DATA           0xC8
+  #define TW_SR_SLA_ACK             0x60
+  #define TW_SR_ARB_LOST_SLA_ACK    0x68
+  #define TW_SR_GCALL_ACK           0x70
+  #define TW_SR_ARB_LOST_GCALL_ACK  0x78
+  #define TW_SR_DATA_ACK            0x80
+  #define TW_SR_DATA_NACK           0x88
+  #define TW_SR_GCALL_DATA_ACK      0x90
+  #define TW_SR_GCALL_DATA_NACK     0x98
+  #define TW_SR_STOP                0xA0
+  #define TW_NO_INFO                0xF8
+  #define TW_BUS_ERROR              0x00
+  #define TW_READ                   1
+  #define TW_WRITE                  0
+
+  // the simulator calls twi_hal_isr() on the node's thread
+  #define TWI_HAL_ISR() void twi_hal_isr(void)
+  void twi_hal_isr(void);
+
+  void twi_hal_control(uint8_t);
+  uint8_t twi_hal_controlState(void);
+  void twi_hal_writeData(uint8_t);
+  uint8_t twi_hal_readData(void);
+  uint8_t twi_hal_status(void);
+  void twi_hal_setAddress(uint8_t);
+  uint8_t twi_hal_address(void);
+  void twi_hal_setBitRate(uint8_t, uint8_t);
+  void twi_hal_idle(void);
+
+#endif
+
+#endif